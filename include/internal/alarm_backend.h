@@ -0,0 +1,73 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ *  @file alarm_backend.h
+ *
+ *  Wakeup alarm backends.
+ *
+ *  A backend arms the one alarm that wakes the device from suspend for the
+ *  next wakeup timeout. "nyx" programs the RTC through nyx; "timerfd" uses a
+ *  timerfd on CLOCK_BOOTTIME_ALARM watched from the main loop, which also
+ *  works on any Linux host without nyx.
+ *
+ *  The backend is chosen with [alarms] backend in sleepd.conf.
+ */
+
+#ifndef __ALARM_BACKEND_H
+#define __ALARM_BACKEND_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * Called from the main loop when the armed alarm goes off
+ */
+typedef void (*AlarmBackendFiredFunc)(void);
+
+typedef struct
+{
+    const char *name;
+
+    /**
+     * @retval false if the backend can't be used on this system
+     */
+    bool (*init)(AlarmBackendFiredFunc fired);
+
+    /**
+     * Arm the alarm for wall time 'expiry', replacing the previous one.
+     * An expiry of 0 disarms it.
+     *
+     * @param notify call the fired function when the alarm goes off, false
+     *        while suspending
+     */
+    bool (*set)(time_t expiry, bool notify);
+} AlarmBackend;
+
+extern const AlarmBackend alarm_backend_nyx;
+extern const AlarmBackend alarm_backend_timerfd;
+
+/**
+ * Select the backend called 'name', falling back to nyx if it is unknown or
+ * fails to initialize
+ */
+void alarm_backend_init(const char *name, AlarmBackendFiredFunc fired);
+
+bool alarm_backend_set(time_t expiry, bool notify);
+
+const char *alarm_backend_name(void);
+
+#endif
@@ -45,6 +45,26 @@ typedef struct
 
     const char *preference_dir;
 
+    /* "nyx" or "timerfd", see alarm_backend.h */
+    const char *alarm_backend;
+
+    /* "sqlite" or "log", see timeout_store.h */
+    const char *alarm_storage;
+
+    /* bus calls of fired timeouts */
+    int alarm_fire_concurrency;
+    int alarm_fire_timeout_ms;
+
+    /* pending timeouts one application may have, 0 for no limit */
+    int alarm_max_timeouts_per_app;
+
+    /* sqlite settings applied by smart_sql_open(); synchronous=off also
+     * skips syncing the timeout log */
+    const char *db_journal_mode;
+    const char *db_synchronous;
+    int db_wal_autocheckpoint;
+    int db_mmap_size;
+
     /* These aren't really config, they are runtime parameters */
     int is_running;
     bool fasthalt;
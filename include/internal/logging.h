@@ -57,15 +57,19 @@
 #define MSGID_ADD_ALARM_INFO                      "ADD_ALARM_INFO"                 //Details of alarm to be added
 #define MSGID_ALARM_ADD_CALENDER_INFO             "ALARM_ADD_CALENDER_INFO"        //Details of alarm to be added with calender date
 #define MSGID_FIRE_ALARM_INFO                     "FIRE_ALARM_INFO"
+#define MSGID_ALARM_DB_READ_ERR                   "ALARM_DB_READ_ERR"              //alarms.xml could not be parsed to the end
+#define MSGID_ALARM_DB_WRITE_ERR                  "ALARM_DB_WRITE_ERR"             //alarms.xml or alarms.log could not be written
 
 /** smartsql.c */
 #define MSGID_SQLITE_PREPARE_ERR                  "SQLITE_PREPARE_ERR"             //sqlite3 prepare error
 #define MSGID_SQLITE_STEP_ERR                     "SQLITE_STEP_ERR"                //sqlite3 step error
 #define MSGID_DB_INTEGRITY_CHK_ERR                "DB_INTEGRITY_CHK_ERR"           //db integrity check error
+#define MSGID_DB_INTEGRITY_CHK_TIME               "DB_INTEGRITY_CHK_TIME"          //time spent checking db integrity
 #define MSGID_JOURNAL_REMOVE_ERR                  "JOURNAL_REMOVE_ERR"             //failed to remove db journal
 #define MSGID_DB_REMOVE_ERR                       "DB_REMOVE_ERR"                  //failed to remove db file
 #define MSGID_INTEGRITY_CHK_FAIL                  "INTEGRITY_CHK_FAIL"             //db integrity check failed
 #define MSGID_SET_SYNCOFF_ERR                     "SET_SYNCOFF_ERR"                //Failed to set syncoff on provided path
+#define MSGID_SET_JOURNAL_MODE_ERR                "SET_JOURNAL_MODE_ERR"           //Failed to set journal mode on provided path
 
 /** timeout_alarm.c */
 #define MSGID_RTC_ERR                             "RTC_ERR"                        //RTC not working properly
@@ -86,11 +90,21 @@
 #define MSGID_DB_OPEN_ERR                         "DB_OPEN_ERR"                    //Failed to open database
 #define MSGID_DB_CREATE_ERR                       "DB_CREATE_ERR"                  //could not create database
 #define MSGID_INDEX_CREATE_FAIL                   "INDEX_CREATE_FAIL"              //could not create index
+#define MSGID_DB_MIGRATION_FAIL                   "DB_MIGRATION_FAIL"              //could not migrate database schema
 #define MSGID_CATEGORY_REG_FAIL                   "CATEGORY_REG_FAIL"              //could not register category
 #define MSGID_METHOD_REG_ERR                      "METHOD_REG_ERR"                 //could not register for suspend resume signal
 #define MSGID_UPDATE_REFERENCE_FAIL               "UPDATE_REFERENCE_FAIL"          //could not update reference clock
 #define MSGID_ALARM_TIMEOUT_INSERT                "ALARM_TIMEOUT_INSERT"           //Insert into AlarmTimeout failed
 #define MSGID_SELECT_ALL_FROM_TIMEOUT             "SELECT_ALL_FROM_TIMEOUT"        //timeout read failed
+#define MSGID_TIMEOUT_QUOTA_EXCEEDED              "TIMEOUT_QUOTA_EXCEEDED"         //too many pending timeouts for one app
+
+/** alarm_backend.c, alarm_backend_timerfd.c, reference_time.c */
+#define MSGID_ALARM_BACKEND_ERR                   "ALARM_BACKEND_ERR"              //wakeup alarm backend not available
+#define MSGID_TIMERFD_ERR                         "TIMERFD_ERR"                    //timerfd call failed
+
+/** timeout_store.c, timeout_store_log.c */
+#define MSGID_TIMEOUT_STORE_ERR                   "TIMEOUT_STORE_ERR"              //timeout storage not available
+#define MSGID_TIMEOUT_LOG_ERR                     "TIMEOUT_LOG_ERR"                //timeout log read or write failed
 
 /** init.c */
 #define MSGID_HOOKINIT_FAIL                       "HOOKINIT_FAIL"                  //Failed to initialize
@@ -24,6 +24,10 @@
  *  system-time and periodically adjusted to match with system-time. This
  *  approach allows to have full control over time adjustion process and fire
  *  time-change events.
+ *
+ *  Relative time is reference time with all of those adjustments taken out
+ *  again. It only moves forward with the boot clock and is suitable for
+ *  storing deadlines that must not follow wall-clock changes.
  */
 
 #ifndef __REFERENCE_TIME_H
@@ -31,12 +35,29 @@
 
 #include <stdbool.h>
 #include <time.h>
+#include <glib.h>
 
 /**
  * System time unaffected by time change since last update_reference_time call
  */
 time_t reference_time(void);
 
+/**
+ * Load the accumulated reference adjustment from state_file and save it
+ * there whenever it changes.
+ */
+void reference_time_init(const char *state_file);
+
+/**
+ * Reference time minus every adjustment since the state file was created
+ */
+time_t relative_time(void);
+
+/**
+ * Offset to add to a relative time to get reference time
+ */
+time_t reference_drift(void);
+
 /**
  * Adjust reference time to system-time and fire callback.
  *
@@ -48,9 +69,25 @@ time_t reference_time(void);
  *
  * @param user_data passed to callback
  *
+ * The first adjustment after start-up only syncs reference time to
+ * system-time and does not change reference_drift().
+ *
  * @retval reference adjustion value
  */
 time_t update_reference_time(bool (*callback)(time_t delta, void *user_data),
                              void *user_data);
 
+/**
+ * Watch for system-time being set, from a timerfd on CLOCK_REALTIME armed
+ * with TFD_TIMER_CANCEL_ON_SET.
+ *
+ * Each time the clock is set, reference time is adjusted as with
+ * update_reference_time() and 'changed' is called with the non-zero
+ * adjustment, from 'context'.
+ *
+ * @retval false if the kernel can't report clock changes, callers then
+ *         have to poll update_reference_time()
+ */
+bool reference_time_watch(GMainContext *context, void (*changed)(time_t delta));
+
 #endif
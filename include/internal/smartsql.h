@@ -19,10 +19,55 @@
 #define _SMARTSQL_H_
 
 #include <sqlite3.h>
+#include <stdbool.h>
 
+/**
+ * Durability settings in effect on an open database
+ */
+typedef struct
+{
+    char journal_mode[16];
+    int synchronous;            /*< 0 off, 1 normal, 2 full, 3 extra */
+    int wal_autocheckpoint;     /*< pages */
+    long long mmap_size;        /*< bytes */
+} SmartSqlProfile;
+
+/**
+ * Time spent in integrity checks of the last smart_sql_open()
+ */
+typedef struct
+{
+    bool clean_shutdown;        /*< clean marker found, quick check used */
+    int quick_ms;               /*< PRAGMA quick_check at open */
+    int full_ms;                /*< PRAGMA integrity_check at open */
+    int deferred_ms;            /*< PRAGMA integrity_check run later when idle */
+    bool deferred_pending;
+} SmartSqlCheckStats;
+
+/**
+ * Open a database and check it, recreating it if it is corrupt.
+ *
+ * If the database was marked clean with smart_sql_mark_clean(), only a quick
+ * check is done here and the full check runs later from an idle callback.
+ */
 bool smart_sql_open(const char *path, sqlite3 **ret_db);
 void smart_sql_close(sqlite3 *db);
 
 bool smart_sql_exec(sqlite3 *db, const char *cmd);
 
+bool smart_sql_get_profile(sqlite3 *db, SmartSqlProfile *profile);
+
+/**
+ * Record that db was left consistent, call on orderly shutdown
+ */
+void smart_sql_mark_clean(sqlite3 *db);
+
+/**
+ * Withdraw smart_sql_mark_clean() before db is written to again, in case
+ * the process keeps running after an orderly shutdown was announced
+ */
+void smart_sql_mark_dirty(sqlite3 *db);
+
+void smart_sql_get_check_stats(SmartSqlCheckStats *stats);
+
 #endif
@@ -33,6 +33,8 @@ typedef struct _AlarmTimeout
     bool        wakeup;
     bool        calendar;
     time_t      expiry;
+    time_t      window;     /*< wakeup may be up to this many seconds late */
+    time_t      repeat;     /*< period in seconds, 0 fires once */
 } _AlarmTimeout;
 
 typedef struct _AlarmTimeoutNonConst
@@ -49,6 +51,8 @@ typedef struct _AlarmTimeoutNonConst
     bool        wakeup;
     bool        calendar;
     time_t      expiry;
+    time_t      window;
+    time_t      repeat;
 } _AlarmTimeoutNonConst;
 
 void _timeout_create(_AlarmTimeout *timeout,
@@ -82,4 +86,12 @@ bool timeout_get_next_wakeup(time_t *expiry, gchar **app_id, gchar **key);
 
 bool update_timeouts_on_resume(void);
 
+/**
+ * Flush the timeout database and mark it as cleanly shut down, so that the
+ * next start only needs a quick integrity check.
+ *
+ * Called when sleepd exits and when the system is about to power off.
+ */
+void timeout_alarm_shutdown(void);
+
 #endif
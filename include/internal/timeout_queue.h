@@ -0,0 +1,130 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ *  @file timeout_queue.h
+ *
+ *  In-memory index of pending timeouts, mirrored from the timeout store.
+ *
+ *  The store (see timeout_store.h) stays the durable copy; this index only
+ *  answers "which timeout is due next" without touching it. Entries are
+ *  keyed by (app_id, key, public_bus). Wakeup timeouts are kept sorted by
+ *  expiry, non-wakeup timeouts in a hierarchical timing wheel with O(1)
+ *  insert and remove.
+ *
+ *  Calendar timeouts expire at a wall time, relative timeouts at a
+ *  relative_time() value (see reference_time.h). Expiries reported back are
+ *  always wall times.
+ *
+ *  A wakeup timeout may carry a window: it is allowed to fire up to that
+ *  many seconds after its expiry, so that several of them can share one
+ *  RTC wakeup.
+ */
+
+#ifndef __TIMEOUT_QUEUE_H
+#define __TIMEOUT_QUEUE_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <glib.h>
+
+void timeout_queue_init(void);
+
+/**
+ * Drop all entries, e.g. before reloading them from the database
+ */
+void timeout_queue_clear(void);
+
+/**
+ * Add a timeout, replacing any entry with the same (app_id, key, public_bus)
+ *
+ * @param expiry wall time if calendar, relative time otherwise
+ * @param window seconds the timeout may fire late, 0 for exact
+ */
+void timeout_queue_put(const char *app_id, const char *key, bool public_bus,
+                       bool wakeup, bool calendar, time_t expiry, time_t window);
+
+/**
+ * Remove the timeout identified by (app_id, key, public_bus)
+ *
+ * @retval false if no such entry was queued
+ */
+bool timeout_queue_remove(const char *app_id, const char *key,
+                          bool public_bus);
+
+/**
+ * @retval true if a timeout with this (app_id, key, public_bus) is queued
+ */
+bool timeout_queue_contains(const char *app_id, const char *key,
+                            bool public_bus);
+
+/**
+ * Number of timeouts queued for 'app_id', on either bus
+ */
+guint timeout_queue_app_count(const char *app_id);
+
+typedef void (*TimeoutQueueAppFunc)(const char *app_id, guint count, void *data);
+
+/**
+ * Call func for every application with queued timeouts. The queue is locked
+ * meanwhile, func must not call back into it.
+ */
+void timeout_queue_foreach_app(TimeoutQueueAppFunc func, void *data);
+
+/**
+ * Set the offset from relative time to wall time, see reference_drift()
+ */
+void timeout_queue_set_drift(time_t drift);
+
+/**
+ * Earliest timeout expiring strictly after wall time 'after'.
+ *
+ * @param wakeup_only ignore non-wakeup timeouts
+ * @param app_id, key if not NULL receive copies of the timeout identity, to
+ *        be released with g_free()
+ *
+ * @retval false if there is no such timeout
+ */
+bool timeout_queue_next(bool wakeup_only, time_t after, time_t *expiry,
+                        gchar **app_id, gchar **key);
+
+/**
+ * Earliest non-wakeup timeout expiring strictly after wall time 'after'.
+ *
+ * @retval false if there is no such timeout
+ */
+bool timeout_queue_next_timer(time_t after, time_t *expiry);
+
+/**
+ * Wall time at which to wake up for the wakeup timeouts expiring after
+ * 'after'.
+ *
+ * This is the earliest deadline (expiry + window) among them. Every wakeup
+ * timeout expiring by then is fired by that same wakeup.
+ *
+ * @param covers if not NULL receives the number of distinct expiry times
+ *        served by the wakeup
+ * @param app_id, key if not NULL receive copies of the identity of the
+ *        timeout setting the deadline, to be released with g_free()
+ *
+ * @retval false if there is no wakeup timeout
+ */
+bool timeout_queue_next_wake(time_t after, time_t *wake, guint *covers,
+                             gchar **app_id, gchar **key);
+
+guint timeout_queue_size(void);
+
+#endif
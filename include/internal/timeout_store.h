@@ -0,0 +1,164 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+ *  @file timeout_store.h
+ *
+ *  Storage engines for pending timeouts.
+ *
+ *  An engine keeps the durable copy of all timeouts, keyed by
+ *  (app_id, key, public_bus). "sqlite" keeps them in SysTimeouts.db;
+ *  "log" keeps them in memory and appends every change to SysTimeouts.log,
+ *  which is compacted into a snapshot of the live timeouts from time to time.
+ *
+ *  Expiries are stored the way timeout_queue.h takes them: wall time for
+ *  calendar timeouts, relative_time() for relative ones. A system time
+ *  change therefore never rewrites stored timeouts.
+ *
+ *  A timeout without an app id is stored with app_id "".
+ *
+ *  The engine is chosen with [alarms] storage in sleepd.conf.
+ */
+
+#ifndef __TIMEOUT_STORE_H
+#define __TIMEOUT_STORE_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <glib.h>
+
+#include "timeout_alarm.h"
+
+/**
+ * Called for each timeout of a scan. Strings are only valid during the call.
+ */
+typedef void (*TimeoutStoreFunc)(const _AlarmTimeout *timeout, void *data);
+
+/**
+ * Called for each timeout of a timeouts/list page, with its wall time expiry
+ * and its position for the next page's cursor
+ */
+typedef void (*TimeoutStoreListFunc)(const _AlarmTimeout *timeout,
+                                     time_t wall_expiry, gint64 id, void *data);
+
+/**
+ * One page of timeouts ordered by (wall expiry, id)
+ */
+typedef struct
+{
+    time_t      after;      /*< page starts after (after, after_id) */
+    gint64      after_id;
+    time_t      until;      /*< last wall expiry, inclusive */
+    const char *app_id;     /*< NULL for all applications */
+    int         wakeup;     /*< 0 or 1, -1 for both */
+    int         limit;
+} TimeoutStoreListQuery;
+
+typedef struct
+{
+    const char *name;
+
+    /**
+     * Open or create the store in directory 'dir'
+     */
+    bool (*open)(const char *dir);
+
+    /**
+     * Make everything durable before sleepd exits or the system powers off
+     */
+    void (*flush)(void);
+
+    /**
+     * Transactions nest, only the outermost commit writes. A transaction
+     * also serializes use of the store between threads.
+     */
+    bool (*begin)(void);
+    bool (*commit)(void);
+    bool (*rollback)(void);
+
+    /**
+     * Add a timeout or replace the one with the same (app_id, key, public_bus)
+     *
+     * @param keep_existing leave an existing timeout untouched
+     * @param kept set to true if an existing timeout was left untouched
+     */
+    bool (*put)(const _AlarmTimeout *timeout, bool keep_existing, bool *kept);
+
+    /**
+     * Read one timeout, release it with _free_timeout_fields()
+     *
+     * @retval false if there is no such timeout
+     */
+    bool (*get)(_AlarmTimeoutNonConst *timeout, const char *app_id,
+                const char *key, bool public_bus);
+
+    bool (*delete)(const char *app_id, const char *key, bool public_bus);
+
+    /**
+     * Call func for every timeout due at wall time 'now' / relative time
+     * 'now_relative', in wall time order. Afterwards repeating timeouts move
+     * to their next period, see timeout_next_repeat(), and the others are
+     * deleted.
+     */
+    bool (*scan_due)(time_t now, time_t now_relative, TimeoutStoreFunc func,
+                     void *data);
+
+    /**
+     * Call func for every timeout, in no particular order
+     */
+    bool (*scan_all)(TimeoutStoreFunc func, void *data);
+
+    /**
+     * Wall expiry of the first wakeup timeout strictly after 'after'
+     */
+    bool (*next_wakeup)(time_t after, time_t *expiry);
+
+    /**
+     * @param more set to true if there are timeouts past this page
+     */
+    bool (*list)(const TimeoutStoreListQuery *query, TimeoutStoreListFunc func,
+                 void *data, bool *more);
+
+    /**
+     * Append the engine's own counters to a diagnostics reply, as
+     * ",\"member\":{...}" JSON members
+     */
+    void (*diagnostics)(GString *payload);
+} TimeoutStore;
+
+extern const TimeoutStore timeout_store_sqlite;
+extern const TimeoutStore timeout_store_log;
+
+/**
+ * Select the engine called 'name', falling back to sqlite if it is unknown
+ *
+ * @retval NULL if the store could not be opened
+ */
+const TimeoutStore *timeout_store_open(const char *name, const char *dir);
+
+/**
+ * Expiry of a repeating timeout after it fired.
+ *
+ * Periods missed while the device was off are skipped, the timeout fires
+ * once and moves to its first period after 'now'.
+ *
+ * @param  expiry  expired, <= now
+ * @param  repeat  period, > 0
+ * @param  now     in the time domain of expiry
+ */
+time_t timeout_next_repeat(time_t expiry, time_t repeat, time_t now);
+
+#endif
@@ -22,15 +22,20 @@
 */
 
 #include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <luna-service2/lunaservice.h>
 
 #include <json.h>
 
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
+#include <libxml/xmlreader.h>
 
 #include "lunaservice_utils.h"
 
@@ -67,7 +72,10 @@
 typedef struct
 {
     int         id;
-    time_t      expiry;    /*< Number of seconds since 1/1/1970 epoch */
+    time_t      expiry;    /*< Number of seconds since 1/1/1970 epoch for
+                            *  calendar alarms, relative_time() for the
+                            *  others, see alarm_wall_expiry().
+                            */
 
     bool        calendar;  /*< If true, Alarm represents a calendar time.
                             *  (i.e. Jan 5, 2009, 10:00am).
@@ -83,16 +91,48 @@ typedef struct
     LSMessage  *message;   /*< Message to reply to. */
 } _Alarm;
 
+/* Fold alarms.log into alarms.xml once it holds at least this many lines,
+ * and more than twice as many as there are alarms. */
+#define ALARM_LOG_COMPACT_MIN 64
+
+/* a burst of changes within this many ms is synced once */
+#define ALARM_LOG_SYNC_MS 500
+
 /**
 * @brief Alarm queue.
+*
+* alarms.xml holds a snapshot of the queue. Each later change is appended
+* to alarms.log as one line:
+*
+*   +	id	expiry	calendar	key	serviceName	applicationName
+*   -	id
+*
+* Fields are separated by tabs, strings are escaped with g_strescape(). The
+* expiry is in the alarm's own time domain, see _Alarm.
+* Replaying a line is idempotent, so a crash between writing a new snapshot
+* and emptying the log is harmless. The snapshot is written to a temporary
+* file and renamed over alarms.xml.
 */
 typedef struct
 {
 
-    GSequence *alarms;
+    /* Relative and calendar alarms, each sorted in its own time domain, so
+     * that a system time change moves neither. Heads are merged on wall
+     * time by alarm_queue_first(). */
+    GSequence *alarms[2];
     uint32_t seq_id;   // points to the next available id
 
+    /* Lookups for alarmRemove and alarmQuery, kept in step with 'alarms'
+     * by alarm_queue_insert() and alarm_queue_remove(). */
+    GHashTable *by_id;       /*< id -> GSequenceIter */
+    GHashTable *by_key;      /*< serviceName and key -> GPtrArray of GSequenceIter */
+
     char *alarm_db;
+
+    char *alarm_log;
+    int log_fd;
+    guint log_lines;
+    guint log_sync_source;   /*< pending debounced sync */
 } _AlarmQueue;
 
 _AlarmQueue *gAlarmQueue = NULL;
@@ -108,6 +148,9 @@ bool alarm_queue_new(const char *key, bool calendar, time_t expiry,
                      int *ret_id);
 
 static bool alarm_write_db(void);
+static void alarm_log_remove(int id);
+static void alarm_queue_remove(GSequenceIter *iter);
+static GPtrArray *alarm_queue_find(const char *serviceName, const char *key);
 static void notify_alarms(void);
 static void update_alarms(void);
 
@@ -230,7 +273,7 @@ alarmAdd(LSHandle *sh, LSMessage *message, void *ctx)
                         "" /*activity_id*/,
                         0 /*activity_duration_ms*/,
                         false /*calendar*/,
-                        alarm_time);
+                        alarm_time - reference_drift() /*relative time*/);
 
         retVal = _timeout_set(&timeout);
 
@@ -551,28 +594,20 @@ alarmQuery(LSHandle *sh, LSMessage *message, void *ctx)
         goto cleanup;
     }
 
-    bool first = true;
-    GSequenceIter *iter = g_sequence_get_begin_iter(gAlarmQueue->alarms);
+    GPtrArray *found = alarm_queue_find(serviceName, key);
 
-    while (!g_sequence_iter_is_end(iter))
+    for (guint i = 0; i < found->len; i++)
     {
-        _Alarm *alarm = (_Alarm *)g_sequence_get(iter);
-        GSequenceIter *next = g_sequence_iter_next(iter);
+        _Alarm *alarm = g_ptr_array_index(found, i);
 
-        if (alarm && alarm->serviceName && alarm->key &&
-                (strcmp(alarm->serviceName, serviceName) == 0) &&
-                (strcmp(alarm->key, key) == 0))
-        {
-            g_string_append_printf(alarm_str,
-                                   "%s{\"alarmId\":%d,\"key\":\"%s\"}",
-                                   first ? "" : "\n,",
-                                   alarm->id, alarm->key);
-            first = false;
-        }
-
-        iter = next;
+        g_string_append_printf(alarm_str,
+                               "%s{\"alarmId\":%d,\"key\":\"%s\"}",
+                               i == 0 ? "" : "\n,",
+                               alarm->id, alarm->key);
     }
 
+    g_ptr_array_free(found, TRUE);
+
     buf = g_string_sized_new(512);
     g_string_append_printf(buf, "{\"alarms\": [%s]}", alarm_str->str);
 
@@ -652,32 +687,27 @@ alarmRemove(LSHandle *sh, LSMessage *message, void *ctx)
     int alarmId =
         json_object_get_int(json_object_object_get(object, "alarmId"));
 
-    GSequenceIter *iter = g_sequence_get_begin_iter(gAlarmQueue->alarms);
+    GSequenceIter *iter = g_hash_table_lookup(gAlarmQueue->by_id,
+                          GINT_TO_POINTER(alarmId));
 
-    while (!g_sequence_iter_is_end(iter))
+    if (iter)
     {
         _Alarm *alarm = (_Alarm *)g_sequence_get(iter);
-        GSequenceIter *next = g_sequence_iter_next(iter);
-
-        if (alarm && alarm->id == alarmId)
-        {
-            char *timeout_key = g_strdup_printf("%s-%d", alarm->key, alarm->id);
-            _timeout_clear("com.palm.sleep", timeout_key,
-                           false /*public_bus*/);
-            g_free(timeout_key);
 
-            g_sequence_remove(iter);
-            found = true;
-        }
+        char *timeout_key = g_strdup_printf("%s-%d", alarm->key, alarm->id);
+        _timeout_clear("com.palm.sleep", timeout_key,
+                       false /*public_bus*/);
+        g_free(timeout_key);
 
-        iter = next;
+        alarm_log_remove(alarm->id);
+        alarm_queue_remove(iter);
+        found = true;
     }
 
     const char *response;
 
     if (found)
     {
-        alarm_write_db();
         response = "{\"returnValue\":true}";
     }
     else
@@ -739,6 +769,7 @@ alarm_free(_Alarm *a)
 {
     SLEEPDLOG_DEBUG("Freeing alarm with id %d", a->id);
 
+    g_free(a->key);
     g_free(a->serviceName);
     g_free(a->applicationName);
 
@@ -750,6 +781,16 @@ alarm_free(_Alarm *a)
     g_free(a);
 }
 
+/**
+* @brief Expiry of an alarm in system time.
+*/
+static time_t
+alarm_wall_expiry(const _Alarm *a)
+{
+    return a->calendar ? a->expiry : a->expiry + reference_drift();
+}
+
+/* orders alarms of one queue, in its time domain */
 static gint
 alarm_cmp_func(_Alarm *a, _Alarm *b, gpointer data)
 {
@@ -761,15 +802,184 @@ static int
 alarm_queue_create(void)
 {
     gAlarmQueue = g_new0(_AlarmQueue, 1);
-    gAlarmQueue->alarms = g_sequence_new((GDestroyNotify)alarm_free);
+    gAlarmQueue->alarms[false] = g_sequence_new((GDestroyNotify)alarm_free);
+    gAlarmQueue->alarms[true] = g_sequence_new((GDestroyNotify)alarm_free);
     gAlarmQueue->seq_id = 0;
 
+    gAlarmQueue->by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gAlarmQueue->by_key = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                          (GDestroyNotify)g_ptr_array_unref);
+
     gAlarmQueue->alarm_db =
         g_build_filename(gSleepConfig.preference_dir, "alarms.xml", NULL);
+    gAlarmQueue->alarm_log =
+        g_build_filename(gSleepConfig.preference_dir, "alarms.log", NULL);
+
+    gAlarmQueue->log_fd = open(gAlarmQueue->alarm_log,
+                               O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                               S_IRUSR | S_IWUSR);
+
+    if (gAlarmQueue->log_fd < 0)
+    {
+        /* every change then rewrites alarms.xml */
+        SLEEPDLOG_WARNING(MSGID_ALARM_DB_WRITE_ERR, 2,
+                          PMLOGKS("File", gAlarmQueue->alarm_log),
+                          PMLOGKS(ERRTEXT, g_strerror(errno)), "could not open alarm log");
+    }
 
     return 0;
 }
 
+/**
+* @brief Key of an alarm in by_key, NULL if it has no serviceName or key.
+*/
+static gchar *
+alarm_key_index(const char *serviceName, const char *key)
+{
+    if (!serviceName || !key)
+    {
+        return NULL;
+    }
+
+    /* the length prefix keeps ("a", "bc") apart from ("ab", "c") */
+    return g_strdup_printf("%zu:%s%s", strlen(serviceName), serviceName, key);
+}
+
+static void
+alarm_index_add(GSequenceIter *iter)
+{
+    _Alarm *alarm = (_Alarm *)g_sequence_get(iter);
+    gchar *index_key = alarm_key_index(alarm->serviceName, alarm->key);
+
+    g_hash_table_insert(gAlarmQueue->by_id, GINT_TO_POINTER(alarm->id), iter);
+
+    if (index_key)
+    {
+        GPtrArray *iters = g_hash_table_lookup(gAlarmQueue->by_key, index_key);
+
+        if (!iters)
+        {
+            iters = g_ptr_array_new();
+            g_hash_table_insert(gAlarmQueue->by_key, index_key, iters);
+        }
+        else
+        {
+            g_free(index_key);
+        }
+
+        g_ptr_array_add(iters, iter);
+    }
+}
+
+/**
+* @brief Queue an alarm at its place in expiry order.
+*/
+static GSequenceIter *
+alarm_queue_insert(_Alarm *alarm)
+{
+    GSequenceIter *iter = g_sequence_insert_sorted(gAlarmQueue->alarms[alarm->calendar],
+                          alarm, (GCompareDataFunc)alarm_cmp_func, NULL);
+
+    alarm_index_add(iter);
+    return iter;
+}
+
+/**
+* @brief Queue an alarm at the end, for loading. The queue must be sorted
+*        afterwards.
+*/
+static GSequenceIter *
+alarm_queue_append(_Alarm *alarm)
+{
+    GSequenceIter *iter = g_sequence_append(gAlarmQueue->alarms[alarm->calendar],
+                                            alarm);
+
+    alarm_index_add(iter);
+    return iter;
+}
+
+/**
+* @brief Remove an alarm from the queue and free it.
+*/
+static void
+alarm_queue_remove(GSequenceIter *iter)
+{
+    _Alarm *alarm = (_Alarm *)g_sequence_get(iter);
+    gchar *index_key = alarm_key_index(alarm->serviceName, alarm->key);
+
+    if (g_hash_table_lookup(gAlarmQueue->by_id,
+                            GINT_TO_POINTER(alarm->id)) == iter)
+    {
+        g_hash_table_remove(gAlarmQueue->by_id, GINT_TO_POINTER(alarm->id));
+    }
+
+    if (index_key)
+    {
+        GPtrArray *iters = g_hash_table_lookup(gAlarmQueue->by_key, index_key);
+
+        if (iters)
+        {
+            g_ptr_array_remove_fast(iters, iter);
+
+            if (iters->len == 0)
+            {
+                g_hash_table_remove(gAlarmQueue->by_key, index_key);
+            }
+        }
+
+        g_free(index_key);
+    }
+
+    g_sequence_remove(iter);
+}
+
+static guint
+alarm_queue_length(void)
+{
+    return g_sequence_get_length(gAlarmQueue->alarms[false]) +
+           g_sequence_get_length(gAlarmQueue->alarms[true]);
+}
+
+static gint
+alarm_ptr_cmp(gconstpointer a, gconstpointer b)
+{
+    const _Alarm *x = *(_Alarm * const *)a;
+    const _Alarm *y = *(_Alarm * const *)b;
+    time_t x_expiry = alarm_wall_expiry(x);
+    time_t y_expiry = alarm_wall_expiry(y);
+
+    if (x_expiry != y_expiry)
+    {
+        return x_expiry < y_expiry ? -1 : 1;
+    }
+
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/**
+* @brief Alarms with this serviceName and key, in expiry order.
+*
+* @retval array of _Alarm, free with g_ptr_array_free()
+*/
+static GPtrArray *
+alarm_queue_find(const char *serviceName, const char *key)
+{
+    gchar *index_key = alarm_key_index(serviceName, key);
+    GPtrArray *iters = index_key ?
+                       g_hash_table_lookup(gAlarmQueue->by_key, index_key) : NULL;
+    GPtrArray *found = g_ptr_array_sized_new(iters ? iters->len : 0);
+
+    for (guint i = 0; iters && i < iters->len; i++)
+    {
+        g_ptr_array_add(found, g_sequence_get(g_ptr_array_index(iters, i)));
+    }
+
+    g_ptr_array_sort(found, alarm_ptr_cmp);
+
+    g_free(index_key);
+    return found;
+}
+
 #define STD_ASCTIME_BUF_SIZE    26
 
 static void
@@ -777,8 +987,9 @@ alarm_print(_Alarm *a)
 {
     char buf[STD_ASCTIME_BUF_SIZE];
     struct tm tm;
+    time_t expiry = alarm_wall_expiry(a);
 
-    gmtime_r(&a->expiry, &tm);
+    gmtime_r(&expiry, &tm);
     asctime_r(&tm, buf);
 
     SLEEPDLOG_DEBUG("(%s,%s) set alarm id %d @ %s",
@@ -787,126 +998,486 @@ alarm_print(_Alarm *a)
                     a->id, buf);
 }
 
+/**
+* @brief Allocate an alarm and reserve its id.
+*
+* The alarm is not queued yet.
+*/
+static _Alarm *
+alarm_create(uint32_t id, const char *key, bool calendar_time,
+             time_t expiry, const char *serviceName,
+             const char *applicationName)
+{
+    _Alarm *alarm = g_new0(_Alarm, 1);
+
+    alarm->key = g_strdup(key);
+    alarm->id = id;
+    alarm->calendar = calendar_time;
+    alarm->expiry = expiry;
+    alarm->serviceName = g_strdup(serviceName);
+    alarm->applicationName = g_strdup(applicationName);
+
+    if (alarm->id >= gAlarmQueue->seq_id)
+    {
+        gAlarmQueue->seq_id = alarm->id + 1;
+    }
+
+    return alarm;
+}
+
+/**
+* @brief Append the <alarm> element under the reader to the queue, unsorted.
+*/
 static void
-alarm_read_db(void)
+alarm_read_element(xmlTextReaderPtr reader)
 {
-    bool retVal;
+    xmlChar *id = xmlTextReaderGetAttribute(reader, (const xmlChar *)"id");
+    xmlChar *key = xmlTextReaderGetAttribute(reader, (const xmlChar *)"key");
+    xmlChar *expiry = xmlTextReaderGetAttribute(reader, (const xmlChar *)"expiry");
+    xmlChar *calendar = xmlTextReaderGetAttribute(reader,
+                        (const xmlChar *)"calendar");
+    xmlChar *service = xmlTextReaderGetAttribute(reader,
+                       (const xmlChar *)"serviceName");
+    xmlChar *app = xmlTextReaderGetAttribute(reader,
+                   (const xmlChar *)"applicationName");
+    xmlChar *relative = xmlTextReaderGetAttribute(reader,
+                        (const xmlChar *)"relative_expiry");
+
+    if (id && expiry)
+    {
+        bool isCalendar = calendar && atoi((const char *)calendar) > 0;
+        time_t expiry_secs = atol((const char *)expiry);
+
+        if (!isCalendar)
+        {
+            /* files written before relative_expiry only have system time */
+            expiry_secs = relative ? atol((const char *)relative) :
+                          expiry_secs - reference_drift();
+        }
 
-    xmlDocPtr db = xmlReadFile(gAlarmQueue->alarm_db, NULL, 0);
+        _Alarm *alarm = alarm_create(atoi((const char *)id), (const char *)key,
+                                     isCalendar, expiry_secs,
+                                     (const char *)service, (const char *)app);
+
+        GSequenceIter *dup = g_hash_table_lookup(gAlarmQueue->by_id,
+                             GINT_TO_POINTER(alarm->id));
+
+        /* the last alarm with an id wins, as in alarm_replay_line() */
+        if (dup)
+        {
+            alarm_queue_remove(dup);
+        }
+
+        alarm_print(alarm);
+        alarm_queue_append(alarm);
+    }
+
+    xmlFree(id);
+    xmlFree(key);
+    xmlFree(expiry);
+    xmlFree(calendar);
+    xmlFree(service);
+    xmlFree(app);
+    xmlFree(relative);
+}
 
-    if (!db)
+/**
+* @brief Load alarms.xml.
+*
+* The file is streamed rather than parsed into a tree. Alarms are appended
+* unsorted, alarm_load() sorts the queue once at the end instead of on
+* every insert. Due alarms are not fired here; alarm_init() runs
+* update_alarms() once afterwards.
+*/
+static void
+alarm_read_db(void)
+{
+    int ret;
+    xmlTextReaderPtr reader;
+
+    if (!g_file_test(gAlarmQueue->alarm_db, G_FILE_TEST_EXISTS))
     {
         return;
     }
 
-    xmlNodePtr cur = xmlDocGetRootElement(db);
-    xmlNodePtr sub;
+    reader = xmlReaderForFile(gAlarmQueue->alarm_db, NULL, XML_PARSE_NONET);
 
-    if (!cur)
+    if (!reader)
     {
         return;
     }
 
-    sub = cur->children;
+    while ((ret = xmlTextReaderRead(reader)) == 1)
+    {
+        if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT &&
+                xmlTextReaderDepth(reader) == 1 &&
+                xmlStrEqual(xmlTextReaderConstName(reader), (const xmlChar *)"alarm"))
+        {
+            alarm_read_element(reader);
+        }
+    }
 
-    while (sub != NULL)
+    if (ret < 0)
     {
-        if (!xmlStrcmp(sub->name, (const xmlChar *)"alarm"))
+        SLEEPDLOG_WARNING(MSGID_ALARM_DB_READ_ERR, 1,
+                          PMLOGKS("File", gAlarmQueue->alarm_db),
+                          "alarm file is damaged, keeping the alarms read before the error");
+    }
+
+    xmlFreeTextReader(reader);
+}
+
+/**
+* @brief Apply one alarms.log line to the unsorted queue.
+*
+* @retval false if the line is malformed
+*/
+static bool
+alarm_replay_line(const char *line)
+{
+    bool ok = true;
+    gchar **fields = g_strsplit(line, "\t", -1);
+    guint n = g_strv_length(fields);
+
+    if (n == 7 && strcmp(fields[0], "+") == 0)
+    {
+        int id = atoi(fields[1]);
+        GSequenceIter *iter = g_hash_table_lookup(gAlarmQueue->by_id,
+                              GINT_TO_POINTER(id));
+        gchar *key = g_strcompress(fields[4]);
+        gchar *service = g_strcompress(fields[5]);
+        gchar *app = g_strcompress(fields[6]);
+
+        if (iter)
         {
-            xmlChar *id = xmlGetProp(sub, (const xmlChar *)"id");
-            xmlChar *key = xmlGetProp(sub, (const xmlChar *)"key");
-            xmlChar *expiry = xmlGetProp(sub, (const xmlChar *)"expiry");
-            xmlChar *calendar = xmlGetProp(sub, (const xmlChar *)"calendar");
-            xmlChar *service = xmlGetProp(sub, (const xmlChar *)"serviceName");
-            xmlChar *app = xmlGetProp(sub, (const xmlChar *)"applicationName");
-
-            if (!id || !expiry)
-            {
-                goto clean_round;
-            }
+            alarm_queue_remove(iter);
+        }
 
-            unsigned long expiry_secs = 0;
-            uint32_t alarmId = 0;
-            bool isCalendar = false;
+        alarm_queue_append(alarm_create(id, key, atoi(fields[3]) > 0,
+                                        g_ascii_strtoll(fields[2], NULL, 10),
+                                        service, app));
 
-            if (expiry)
-            {
-                expiry_secs = atol((const char *)expiry);
-            }
+        g_free(app);
+        g_free(service);
+        g_free(key);
+    }
+    else if (n == 2 && strcmp(fields[0], "-") == 0)
+    {
+        int id = atoi(fields[1]);
+        GSequenceIter *iter = g_hash_table_lookup(gAlarmQueue->by_id,
+                              GINT_TO_POINTER(id));
 
-            if (id)
-            {
-                alarmId = atoi((const char *)id);
-            }
+        if (iter)
+        {
+            alarm_queue_remove(iter);
+        }
+    }
+    else
+    {
+        ok = false;
+    }
 
-            if (calendar)
-            {
-                isCalendar = atoi((const char *)calendar) > 0;
-            }
+    g_strfreev(fields);
+    return ok;
+}
 
-            retVal = alarm_queue_add(alarmId, (const char *)key,
-                                     isCalendar, expiry_secs,
-                                     (const char *)service,
-                                     (const char *)app, false, NULL);
+/**
+* @brief Replay alarms.log on top of the alarms read from alarms.xml.
+*
+* A last line without its newline was cut short by a crash and is dropped.
+*
+* @retval true if the log holds anything, replayed lines or a torn tail,
+*         and has to be folded into a new snapshot
+*/
+static bool
+alarm_replay_log(void)
+{
+    gchar *contents;
+    gsize length;
+    guint replayed = 0;
 
-            if (!retVal)
-            {
-                SLEEPDLOG_WARNING(MSGID_ALARM_NOT_SET, 3, PMLOGKFV(ALARM_ID, "%d", alarmId),
-                                  PMLOGKS(SRVC_NAME, service), PMLOGKS(APP_NAME, app), "could not add alarm");
-            }
+    if (!g_file_get_contents(gAlarmQueue->alarm_log, &contents, &length, NULL))
+    {
+        return false;
+    }
 
-clean_round:
-            xmlFree(expiry);
-            xmlFree(service);
-            xmlFree(app);
+    gchar **lines = g_strsplit(contents, "\n", -1);
+
+    /* the piece after the last newline is either empty or torn */
+    for (int i = 0; lines[i] && lines[i + 1]; i++)
+    {
+        if (lines[i][0] == '\0')
+        {
+            continue;
         }
 
-        sub = sub->next;
+        if (!alarm_replay_line(lines[i]))
+        {
+            SLEEPDLOG_WARNING(MSGID_ALARM_DB_READ_ERR, 2,
+                              PMLOGKS("File", gAlarmQueue->alarm_log),
+                              PMLOGKFV("Line", "%d", i + 1), "skipping malformed alarm log line");
+        }
+
+        replayed++;
+    }
+
+    if (length > 0 && contents[length - 1] != '\n')
+    {
+        SLEEPDLOG_WARNING(MSGID_ALARM_DB_READ_ERR, 1,
+                          PMLOGKS("File", gAlarmQueue->alarm_log),
+                          "dropping torn last alarm log line");
     }
 
-    xmlFreeDoc(db);
+    g_strfreev(lines);
+    g_free(contents);
+
+    SLEEPDLOG_DEBUG("replayed %u alarm log lines", replayed);
+
+    return length > 0;
 }
 
+/**
+* @brief Stop logging, every later change rewrites alarms.xml.
+*
+* Used when alarms.log can't be emptied: a line appended behind a torn one
+* would be lost on the next load.
+*/
 static void
-alarm_save(_Alarm *a, FILE *file)
+alarm_log_disable(void)
+{
+    if (gAlarmQueue->log_fd >= 0)
+    {
+        close(gAlarmQueue->log_fd);
+        gAlarmQueue->log_fd = -1;
+    }
+
+    SLEEPDLOG_WARNING(MSGID_ALARM_DB_WRITE_ERR, 1,
+                      PMLOGKS("File", gAlarmQueue->alarm_log),
+                      "could not empty alarm log, writing snapshots only");
+}
+
+/**
+* @brief Load the alarm queue from alarms.xml and alarms.log.
+*/
+static void
+alarm_load(void)
+{
+    alarm_read_db();
+
+    bool replayed = alarm_replay_log();
+
+    g_sequence_sort(gAlarmQueue->alarms[false], (GCompareDataFunc)alarm_cmp_func,
+                    NULL);
+    g_sequence_sort(gAlarmQueue->alarms[true], (GCompareDataFunc)alarm_cmp_func,
+                    NULL);
+
+    /* start from a fresh snapshot and an empty log, so that new lines are
+     * never appended to a torn one */
+    if (replayed && !alarm_write_db() && gAlarmQueue->log_fd >= 0)
+    {
+        alarm_log_disable();
+    }
+}
+
+static void
+alarm_save(_Alarm *a, GString *snapshot)
 {
     char buf[STD_ASCTIME_BUF_SIZE];
     struct tm tm;
+    time_t expiry = alarm_wall_expiry(a);
 
-    gmtime_r(&a->expiry, &tm);
+    gmtime_r(&expiry, &tm);
 
     asctime_r(&tm, buf);
     g_strchomp(buf);
 
-    fprintf(file, "<alarm id='%d' expiry='%ld' calendar='%d'"
-            " key='%s'"
-            " expiry_text='%s'"
-            " serviceName='%s'"
-            " applicationName='%s'/>\n",
-            a->id, a->expiry, a->calendar,
-            a->key, buf, a->serviceName ? : "", a->applicationName ? : "");
+    g_string_append_printf(snapshot, "<alarm id='%d' expiry='%ld' calendar='%d'"
+                           " key='%s'"
+                           " expiry_text='%s'"
+                           " serviceName='%s'"
+                           " applicationName='%s'",
+                           a->id, expiry, a->calendar,
+                           a->key, buf, a->serviceName ? : "", a->applicationName ? : "");
+
+    /* expiry above is only informational for relative alarms, it goes
+     * stale with the next system time change */
+    if (!a->calendar)
+    {
+        g_string_append_printf(snapshot, " relative_expiry='%ld'", a->expiry);
+    }
+
+    g_string_append(snapshot, "/>\n");
 }
 
+/**
+* @brief Write a snapshot of the queue to alarms.xml and empty alarms.log.
+*/
 static bool
 alarm_write_db(void)
 {
-    bool retVal = false;
+    GError *error = NULL;
+    GString *snapshot = g_string_sized_new(160 * alarm_queue_length() + 32);
+
+    g_string_append(snapshot, "<alarms>\n");
+    g_sequence_foreach(gAlarmQueue->alarms[true], (GFunc)alarm_save, snapshot);
+    g_sequence_foreach(gAlarmQueue->alarms[false], (GFunc)alarm_save, snapshot);
+    g_string_append(snapshot, "</alarms>\n");
 
-    FILE *file = fopen(gAlarmQueue->alarm_db, "w");
+    /* written to a temporary file, synced and renamed over alarms.xml */
+    bool retVal = g_file_set_contents(gAlarmQueue->alarm_db, snapshot->str,
+                                      snapshot->len, &error);
+    g_string_free(snapshot, TRUE);
 
-    if (!file)
+    if (!retVal)
     {
-        goto cleanup;
+        SLEEPDLOG_WARNING(MSGID_ALARM_DB_WRITE_ERR, 2,
+                          PMLOGKS("File", gAlarmQueue->alarm_db),
+                          PMLOGKS(ERRTEXT, error->message), "could not write alarms");
+        g_error_free(error);
+        return false;
     }
 
-    fprintf(file, "<alarms>\n");
-    g_sequence_foreach(gAlarmQueue->alarms, (GFunc)alarm_save, file);
-    fprintf(file, "</alarms>\n");
-    fclose(file);
+    if (gAlarmQueue->log_fd >= 0)
+    {
+        if (ftruncate(gAlarmQueue->log_fd, 0) == 0)
+        {
+            gAlarmQueue->log_lines = 0;
+            return true;
+        }
 
-    retVal = true;
-cleanup:
-    return retVal;
+        SLEEPDLOG_WARNING(MSGID_ALARM_DB_WRITE_ERR, 2,
+                          PMLOGKS("File", gAlarmQueue->alarm_log),
+                          PMLOGKS(ERRTEXT, g_strerror(errno)), "could not empty alarm log");
+        alarm_log_disable();
+    }
+
+    /* With logging off, whatever alarms.log still holds predates this
+     * snapshot and must not be replayed over it on the next load. */
+    if (unlink(gAlarmQueue->alarm_log) != 0 && errno != ENOENT)
+    {
+        SLEEPDLOG_WARNING(MSGID_ALARM_DB_WRITE_ERR, 2,
+                          PMLOGKS("File", gAlarmQueue->alarm_log),
+                          PMLOGKS(ERRTEXT, g_strerror(errno)), "could not remove alarm log");
+        return false;
+    }
+
+    gAlarmQueue->log_lines = 0;
+
+    return true;
+}
+
+/**
+* @brief Sync alarms.log, or fold it into alarms.xml if it has grown.
+*/
+static gboolean
+alarm_log_sync(gpointer data)
+{
+    gAlarmQueue->log_sync_source = 0;
+
+    if (gAlarmQueue->log_lines >= ALARM_LOG_COMPACT_MIN &&
+            gAlarmQueue->log_lines > 2 * alarm_queue_length())
+    {
+        alarm_write_db();
+    }
+    /* follows the durability chosen for the databases */
+    else if (g_strcmp0(gSleepConfig.db_synchronous, "off") != 0)
+    {
+        fdatasync(gAlarmQueue->log_fd);
+    }
+
+    return FALSE;
+}
+
+/**
+* @brief Append one change to alarms.log.
+*
+* The line is written right away, so it survives a crash of sleepd. Syncing
+* it to disk is deferred by ALARM_LOG_SYNC_MS, so that a burst of changes
+* costs one sync.
+*/
+static void
+alarm_log_append(GString *line)
+{
+    bool written = gAlarmQueue->log_fd >= 0;
+    const char *buf = line->str;
+    gsize len = line->len;
+
+    while (written && len > 0)
+    {
+        ssize_t n = write(gAlarmQueue->log_fd, buf, len);
+
+        if (n < 0 && errno != EINTR)
+        {
+            written = false;
+        }
+        else if (n > 0)
+        {
+            buf += n;
+            len -= n;
+        }
+    }
+
+    if (!written)
+    {
+        /* the snapshot replaces a partial line; if the log can't be
+         * emptied, the next line would land behind it */
+        if (!alarm_write_db() && gAlarmQueue->log_fd >= 0)
+        {
+            alarm_log_disable();
+        }
+
+        return;
+    }
+
+    gAlarmQueue->log_lines++;
+
+    if (!gAlarmQueue->log_sync_source)
+    {
+        gAlarmQueue->log_sync_source = g_timeout_add(ALARM_LOG_SYNC_MS,
+                                       alarm_log_sync, NULL);
+    }
+}
+
+static void
+alarm_log_put(_Alarm *a)
+{
+    GString *line = g_string_sized_new(160);
+    gchar *key = g_strescape(a->key ? : "", NULL);
+    gchar *service = g_strescape(a->serviceName ? : "", NULL);
+    gchar *app = g_strescape(a->applicationName ? : "", NULL);
+
+    g_string_append_printf(line, "+\t%d\t%ld\t%d\t%s\t%s\t%s\n",
+                           a->id, a->expiry, a->calendar, key, service, app);
+    alarm_log_append(line);
+
+    g_free(app);
+    g_free(service);
+    g_free(key);
+    g_string_free(line, TRUE);
+}
+
+static void
+alarm_log_remove(int id)
+{
+    GString *line = g_string_sized_new(16);
+
+    g_string_append_printf(line, "-\t%d\n", id);
+    alarm_log_append(line);
+
+    g_string_free(line, TRUE);
+}
+
+/**
+* @brief Sync a pending change to alarms.log now, before sleepd exits.
+*/
+void
+alarm_flush(void)
+{
+    if (gAlarmQueue && gAlarmQueue->log_sync_source)
+    {
+        g_source_remove(gAlarmQueue->log_sync_source);
+        alarm_log_sync(NULL);
+    }
 }
 
 /**
@@ -936,89 +1507,71 @@ alarm_queue_new(const char *key, bool calendar_time, time_t expiry,
         *ret_id = id;
     }
 
+    /* relative alarms are queued in relative time */
+    if (!calendar_time)
+    {
+        expiry -= reference_drift();
+    }
+
     retVal = alarm_queue_add(id, key, calendar_time, expiry,
                              serviceName, applicationName,
                              subscribe, message);
 
-    if (retVal)
-    {
-        alarm_write_db();
-    }
-
     return retVal;
 }
 
 /**
-* @brief Obtain the next alarm that will fire.
+* @brief Position of the next alarm that will fire, the earlier of the two
+*        queue heads in system time.
 *
+* @retval NULL if there are no alarms
 */
-_Alarm *
-alarm_queue_get_first(void)
+static GSequenceIter *
+alarm_queue_first(void)
 {
-    GSequenceIter *seq =
-        g_sequence_get_begin_iter(gAlarmQueue->alarms);
+    GSequenceIter *rel = g_sequence_get_begin_iter(gAlarmQueue->alarms[false]);
+    GSequenceIter *cal = g_sequence_get_begin_iter(gAlarmQueue->alarms[true]);
 
-    if (g_sequence_iter_is_end(seq))
+    if (g_sequence_iter_is_end(rel))
     {
-        return NULL;
+        return g_sequence_iter_is_end(cal) ? NULL : cal;
     }
 
-    _Alarm *alarm = (_Alarm *)g_sequence_get(seq);
-    return alarm;
+    if (g_sequence_iter_is_end(cal))
+    {
+        return rel;
+    }
+
+    return alarm_wall_expiry(g_sequence_get(cal)) <=
+           alarm_wall_expiry(g_sequence_get(rel)) ? cal : rel;
 }
 
 /**
-* @brief Adjusts the alarm when a time set occurs and the wall clock
-*        and rtc clock diverge.
-*
-* This should also be called on init, in case of a crash before we
-* were able to adjust the alarms successfully.
+* @brief Obtain the next alarm that will fire.
 *
 */
-void
-recalculate_alarms(time_t delta)
+_Alarm *
+alarm_queue_get_first(void)
 {
-    if (delta)
-    {
-        /* Adjust each fixed time alarm by the delta.
-         * i.e. 5 seconds in the future + delta = T + 5 + delta
-         */
-        GSequenceIter *iter = g_sequence_get_begin_iter(gAlarmQueue->alarms);
+    GSequenceIter *seq = alarm_queue_first();
 
-        while (!g_sequence_iter_is_end(iter))
-        {
-            _Alarm *alarm = (_Alarm *)g_sequence_get(iter);
-            GSequenceIter *next = g_sequence_iter_next(iter);
-
-            if (alarm && !alarm->calendar)
-            {
-                alarm->expiry += delta;
-            }
-
-            iter = next;
-        }
-
-        /* resort */
-        g_sequence_sort(gAlarmQueue->alarms,
-                        (GCompareDataFunc)alarm_cmp_func, NULL);
-
-        /* persist */
-        alarm_write_db();
+    if (!seq)
+    {
+        return NULL;
     }
 
-    return;
+    _Alarm *alarm = (_Alarm *)g_sequence_get(seq);
+    return alarm;
 }
 
 void
 update_alarms_delta(time_t delta)
 {
-    /* If the time changed, we need to readjust alarms,
-     * and persist the changes.
+    /* A time change needs no adjustment: relative alarms are kept in
+     * relative time, which a change does not move, and calendar alarms
+     * follow system time by definition. Moving forward may have made
+     * calendar alarms due though.
      */
-    if (delta)
-    {
-        recalculate_alarms(delta);
-    }
 
     /* Trigger any pending alarms and remove them from the queue.
      */
@@ -1051,14 +1604,8 @@ alarm_queue_add(uint32_t id, const char *key, bool calendar_time,
                 const char *applicationName,
                 bool subscribe, LSMessage *message)
 {
-    _Alarm *alarm = g_new0(_Alarm, 1);
-
-    alarm->key = g_strdup(key);
-    alarm->id = id;
-    alarm->calendar = calendar_time;
-    alarm->expiry = expiry;
-    alarm->serviceName = g_strdup(serviceName);
-    alarm->applicationName = g_strdup(applicationName);
+    _Alarm *alarm = alarm_create(id, key, calendar_time, expiry,
+                                 serviceName, applicationName);
 
     if (subscribe)
     {
@@ -1080,18 +1627,15 @@ alarm_queue_add(uint32_t id, const char *key, bool calendar_time,
 
     alarm_print(alarm);
 
-    if (alarm->id >= gAlarmQueue->seq_id)
-    {
-        gAlarmQueue->seq_id = alarm->id + 1;
-    }
+    alarm_queue_insert(alarm);
 
-    g_sequence_insert_sorted(gAlarmQueue->alarms,
-                             alarm, (GCompareDataFunc)alarm_cmp_func,
-                             NULL);
+    /* logged before update_alarms() can fire and log its removal */
+    alarm_log_put(alarm);
 
     update_alarms();
     return true;
 error:
+    alarm_free(alarm);
     return false;
 }
 
@@ -1110,8 +1654,9 @@ fire_alarm(_Alarm *alarm)
 
     struct tm tm_alarm;
     time_t rtctime = 0;
+    time_t expiry = alarm_wall_expiry(alarm);
 
-    gmtime_r(&alarm->expiry, &tm_alarm);
+    gmtime_r(&expiry, &tm_alarm);
     asctime_r(&tm_alarm, buf_alarm);
 
     nyx_system_query_rtc_time(GetNyxSystemDevice(), &rtctime);
@@ -1176,31 +1721,23 @@ static void
 notify_alarms(void)
 {
     time_t now;
-    bool fired = false;
+    GSequenceIter *iter;
 
     now = reference_time();
 
-    GSequenceIter *iter = g_sequence_get_begin_iter(gAlarmQueue->alarms);
-
-    while (!g_sequence_iter_is_end(iter))
+    /* both queues are sorted, so due alarms are at their heads */
+    while ((iter = alarm_queue_first()) != NULL)
     {
         _Alarm *alarm = (_Alarm *)g_sequence_get(iter);
-        GSequenceIter *next = g_sequence_iter_next(iter);
 
-        if (alarm && alarm->expiry <= now)
+        if (alarm_wall_expiry(alarm) > now)
         {
-            fire_alarm(alarm);
-            g_sequence_remove(iter);
-
-            fired = true;
+            break;
         }
 
-        iter = next;
-    }
-
-    if (fired)
-    {
-        alarm_write_db();
+        fire_alarm(alarm);
+        alarm_log_remove(alarm->id);
+        alarm_queue_remove(iter);
     }
 }
 
@@ -1221,7 +1758,7 @@ alarm_init(void)
     }
 
     alarm_queue_create();
-    alarm_read_db();
+    alarm_load();
 
     update_alarms();
     return 0;
@@ -0,0 +1,121 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+* @file alarm_backend.c
+*
+* @brief Wakeup alarm backend selection, and the nyx backend.
+*
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <nyx/nyx_client.h>
+
+#include "main.h"
+#include "logging.h"
+#include "alarm_backend.h"
+
+static AlarmBackendFiredFunc nyx_fired = NULL;
+
+static const AlarmBackend *backends[] =
+{
+    &alarm_backend_nyx,
+    &alarm_backend_timerfd,
+};
+
+/* nyx until alarm_backend_init() picks one, so that shutdown can always
+ * disarm the RTC */
+static const AlarmBackend *backend = &alarm_backend_nyx;
+
+static void
+_nyx_alarm_fired(nyx_device_handle_t handle, nyx_callback_status_t status,
+                 void *data)
+{
+    if (nyx_fired)
+    {
+        nyx_fired();
+    }
+}
+
+static bool
+_nyx_init(AlarmBackendFiredFunc fired)
+{
+    nyx_fired = fired;
+    return GetNyxSystemDevice() != NULL;
+}
+
+static bool
+_nyx_set(time_t expiry, bool notify)
+{
+    // For callback function, nyx-modules uses glib watch function.
+    // This makes problem that Luns Service API is blocked.
+    nyx_error_t nyx_error = nyx_system_set_alarm(GetNyxSystemDevice(), expiry,
+                            (expiry && notify) ? _nyx_alarm_fired : NULL, NULL);
+
+    if (nyx_error != NYX_ERROR_NONE)
+    {
+        SLEEPDLOG_DEBUG("Failed to setup RTC wakeup alarm: %d", nyx_error);
+        return false;
+    }
+
+    return true;
+}
+
+const AlarmBackend alarm_backend_nyx =
+{
+    .name = "nyx",
+    .init = _nyx_init,
+    .set = _nyx_set,
+};
+
+void
+alarm_backend_init(const char *name, AlarmBackendFiredFunc fired)
+{
+    for (int i = 0; i < G_N_ELEMENTS(backends); i++)
+    {
+        if (name && strcmp(name, backends[i]->name) == 0)
+        {
+            if (backends[i]->init(fired))
+            {
+                backend = backends[i];
+                SLEEPDLOG_DEBUG("using %s wakeup alarms", backend->name);
+                return;
+            }
+
+            break;
+        }
+    }
+
+    SLEEPDLOG_WARNING(MSGID_ALARM_BACKEND_ERR, 1, PMLOGKS("Backend", name ? : "(null)"),
+                      "wakeup alarm backend not available, using nyx");
+
+    backend = &alarm_backend_nyx;
+    backend->init(fired);
+}
+
+bool
+alarm_backend_set(time_t expiry, bool notify)
+{
+    return backend->set(expiry, notify);
+}
+
+const char *
+alarm_backend_name(void)
+{
+    return backend->name;
+}
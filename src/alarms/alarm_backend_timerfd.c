@@ -0,0 +1,193 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+* @file alarm_backend_timerfd.c
+*
+* @brief Wakeup alarms on a timerfd.
+*
+* CLOCK_BOOTTIME_ALARM wakes the device from suspend but needs
+* CAP_WAKE_ALARM. Without it the timer runs on CLOCK_BOOTTIME, which keeps
+* counting through suspend: the alarm then can't wake the device, but fires
+* as soon as it resumes.
+*
+*/
+
+#include <glib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/timerfd.h>
+
+#include "main.h"
+#include "logging.h"
+#include "alarm_backend.h"
+
+#ifndef CLOCK_BOOTTIME_ALARM
+#define CLOCK_BOOTTIME_ALARM 9
+#endif
+
+#define NSECS_PER_SEC 1000000000LL
+
+/**
+* @brief A GSource polling the timerfd.
+*/
+typedef struct
+{
+    GSource source;
+    GPollFD poll;
+} _TimerfdSource;
+
+static _TimerfdSource *timerfd_source = NULL;
+static AlarmBackendFiredFunc timerfd_fired = NULL;
+static bool timerfd_notify = false;
+
+static gboolean
+_timerfd_prepare(GSource *source, gint *timeout_ms)
+{
+    *timeout_ms = -1;
+    return FALSE;
+}
+
+static gboolean
+_timerfd_check(GSource *source)
+{
+    _TimerfdSource *tsource = (_TimerfdSource *) source;
+
+    return (tsource->poll.revents & G_IO_IN) != 0;
+}
+
+static gboolean
+_timerfd_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    _TimerfdSource *tsource = (_TimerfdSource *) source;
+    uint64_t expirations;
+
+    /* drain it, or it stays readable */
+    if (read(tsource->poll.fd, &expirations, sizeof(expirations)) < 0 &&
+            errno != EAGAIN)
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMERFD_ERR, 1, PMLOGKS(ERRTEXT, strerror(errno)),
+                          "timerfd read failed");
+    }
+
+    if (timerfd_notify && timerfd_fired)
+    {
+        timerfd_fired();
+    }
+
+    return TRUE;
+}
+
+static GSourceFuncs timerfd_source_funcs =
+{
+    .prepare  = _timerfd_prepare,
+    .check    = _timerfd_check,
+    .dispatch = _timerfd_dispatch,
+    .finalize = NULL,
+};
+
+static bool
+_timerfd_init(AlarmBackendFiredFunc fired)
+{
+    int fd;
+
+    if (timerfd_source)
+    {
+        timerfd_fired = fired;
+        return true;
+    }
+
+    fd = timerfd_create(CLOCK_BOOTTIME_ALARM, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0)
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMERFD_ERR, 1, PMLOGKS(ERRTEXT, strerror(errno)),
+                          "no CLOCK_BOOTTIME_ALARM, wakeup alarms will not wake the device");
+
+        fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+
+    if (fd < 0)
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMERFD_ERR, 1, PMLOGKS(ERRTEXT, strerror(errno)),
+                          "timerfd_create failed");
+        return false;
+    }
+
+    timerfd_source = (_TimerfdSource *) g_source_new(&timerfd_source_funcs,
+                     sizeof(_TimerfdSource));
+    timerfd_source->poll.fd = fd;
+    timerfd_source->poll.events = G_IO_IN;
+    g_source_add_poll((GSource *) timerfd_source, &timerfd_source->poll);
+    g_source_attach((GSource *) timerfd_source, GetMainLoopContext());
+
+    timerfd_fired = fired;
+    return true;
+}
+
+static bool
+_timerfd_set(time_t expiry, bool notify)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+
+    if (!timerfd_source)
+    {
+        return false;
+    }
+
+    timerfd_notify = notify;
+
+    /* The timer runs on the boot clock, expiry is a wall time: arm it
+     * relative to now. An expiry already past fires right away. */
+    if (expiry)
+    {
+        struct timespec now;
+        long long delta_ns;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        delta_ns = (long long) expiry * NSECS_PER_SEC -
+                   ((long long) now.tv_sec * NSECS_PER_SEC + now.tv_nsec);
+
+        if (delta_ns < 1)
+        {
+            delta_ns = 1;
+        }
+
+        spec.it_value.tv_sec = delta_ns / NSECS_PER_SEC;
+        spec.it_value.tv_nsec = delta_ns % NSECS_PER_SEC;
+    }
+
+    if (timerfd_settime(timerfd_source->poll.fd, 0, &spec, NULL) < 0)
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMERFD_ERR, 1, PMLOGKS(ERRTEXT, strerror(errno)),
+                          "timerfd_settime failed");
+        return false;
+    }
+
+    return true;
+}
+
+const AlarmBackend alarm_backend_timerfd =
+{
+    .name = "timerfd",
+    .init = _timerfd_init,
+    .set = _timerfd_set,
+};
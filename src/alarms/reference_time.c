@@ -20,11 +20,79 @@
  *  Implmenetation of reference time source
  */
 
+#include <glib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
 #include "reference_time.h"
+#include "logging.h"
 
 static time_t clock_to_reference = 0;
 static const time_t invalid_time = ((time_t) - 1);
 
+/* Sum of all adjustments applied to reference time after the first one.
+ * Persisted so relative time keeps running across restarts. */
+static time_t reference_to_relative = 0;
+static char *drift_file = NULL;
+
+/* The first adjustment only brings the boot clock to system time and is not a
+ * time change. */
+static bool reference_synced = false;
+
+/* an expiry the clock watch never reaches, it only waits for cancellation */
+#define TIME_T_MAX ((time_t) ((1ULL << (sizeof(time_t) * 8 - 1)) - 1))
+
+/**
+ * GSource of the clock watch timerfd
+ */
+typedef struct
+{
+    GSource source;
+    GPollFD poll;
+    void (*changed)(time_t delta);
+} ClockWatchSource;
+
+static void reference_drift_save(void)
+{
+    gchar buf[32];
+    GError *error = NULL;
+
+    if (!drift_file)
+    {
+        return;
+    }
+
+    g_snprintf(buf, sizeof(buf), "%ld", (long) reference_to_relative);
+
+    /* written to a temporary file and renamed over the old one */
+    if (!g_file_set_contents(drift_file, buf, -1, &error))
+    {
+        SLEEPDLOG_WARNING(MSGID_TIME_NOT_SAVED, 2, PMLOGKS("FileName", drift_file),
+                          PMLOGKS(ERRTEXT, error->message), "Could not save reference drift");
+        g_error_free(error);
+    }
+}
+
+void reference_time_init(const char *state_file)
+{
+    gchar *contents = NULL;
+
+    g_free(drift_file);
+    drift_file = g_strdup(state_file);
+
+    if (g_file_get_contents(drift_file, &contents, NULL, NULL))
+    {
+        reference_to_relative = strtol(contents, NULL, 10);
+        g_free(contents);
+    }
+
+    SLEEPDLOG_DEBUG("reference drift %ld", (long) reference_to_relative);
+}
+
 /**
  * Get current reference time value (seconds since epoch)
  *
@@ -54,6 +122,16 @@ time_t reference_time(void)
            : time(NULL);
 }
 
+time_t relative_time(void)
+{
+    return reference_time() - reference_to_relative;
+}
+
+time_t reference_drift(void)
+{
+    return reference_to_relative;
+}
+
 time_t update_reference_time(bool (*callback)(time_t delta, void *user_data),
                              void *user_data)
 {
@@ -71,7 +149,10 @@ time_t update_reference_time(bool (*callback)(time_t delta, void *user_data),
 
     delta = systime - reftime;
 
-    if (!delta)
+    /* Both clocks are read in whole seconds, so their difference flaps by a
+     * second without anyone setting the time. Once synced, such a flap must
+     * not move relative expiries or rewrite the drift file. */
+    if (!delta || (reference_synced && delta >= -1 && delta <= 1))
     {
         return 0;    /* no need to adjust */
     }
@@ -79,6 +160,14 @@ time_t update_reference_time(bool (*callback)(time_t delta, void *user_data),
     if (callback == NULL || callback(delta, user_data))
     {
         clock_to_reference += delta;
+
+        if (reference_synced)
+        {
+            reference_to_relative += delta;
+            reference_drift_save();
+        }
+
+        reference_synced = true;
         return delta;
     }
     else
@@ -87,3 +176,92 @@ time_t update_reference_time(bool (*callback)(time_t delta, void *user_data),
         return 0;
     }
 }
+
+static bool clock_watch_arm(int fd)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = TIME_T_MAX;
+
+    return timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                           &spec, NULL) == 0;
+}
+
+static gboolean clock_watch_prepare(GSource *source, gint *timeout_ms)
+{
+    *timeout_ms = -1;
+    return FALSE;
+}
+
+static gboolean clock_watch_check(GSource *source)
+{
+    ClockWatchSource *watch = (ClockWatchSource *) source;
+
+    return (watch->poll.revents & G_IO_IN) != 0;
+}
+
+static gboolean clock_watch_dispatch(GSource *source, GSourceFunc callback,
+                                     gpointer user_data)
+{
+    ClockWatchSource *watch = (ClockWatchSource *) source;
+    uint64_t expirations;
+    time_t delta;
+
+    /* fails with ECANCELED once the clock was set, and the timer has to be
+     * armed again to hear about the next change */
+    if (read(watch->poll.fd, &expirations, sizeof(expirations)) < 0 &&
+            errno != ECANCELED && errno != EAGAIN)
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMERFD_ERR, 1, PMLOGKS(ERRTEXT, strerror(errno)),
+                          "clock watch read failed");
+    }
+
+    clock_watch_arm(watch->poll.fd);
+
+    delta = update_reference_time(NULL, NULL);
+
+    if (delta != invalid_time && delta != 0)
+    {
+        watch->changed(delta);
+    }
+
+    return TRUE;
+}
+
+static GSourceFuncs clock_watch_funcs =
+{
+    .prepare  = clock_watch_prepare,
+    .check    = clock_watch_check,
+    .dispatch = clock_watch_dispatch,
+    .finalize = NULL,
+};
+
+bool reference_time_watch(GMainContext *context, void (*changed)(time_t delta))
+{
+    int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (!clock_watch_arm(fd))
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMERFD_ERR, 1, PMLOGKS(ERRTEXT, strerror(errno)),
+                          "clock changes will be polled");
+        close(fd);
+        return false;
+    }
+
+    ClockWatchSource *watch = (ClockWatchSource *) g_source_new(&clock_watch_funcs,
+                              sizeof(ClockWatchSource));
+    watch->poll.fd = fd;
+    watch->poll.events = G_IO_IN;
+    watch->changed = changed;
+    g_source_add_poll((GSource *) watch, &watch->poll);
+    g_source_attach((GSource *) watch, context);
+    g_source_unref((GSource *) watch);
+
+    return true;
+}
@@ -23,25 +23,45 @@
 
 #include <sqlite3.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <glib.h>
 
 #include <luna-service2/lunaservice.h>
 
+#include "config.h"
 #include "logging.h"
+#include "smartsql.h"
 
 #define LOG_DOMAIN "POWERD-SMARTSQL: "
 
+/* Created next to a database by smart_sql_mark_clean(), removed on open */
+#define CLEAN_MARKER_SUFFIX "-clean"
+
 /**
  * @addtogroup NewInterface
  * @{
  */
 
+static SmartSqlCheckStats check_stats;
+
+/* full check postponed by smart_sql_open() after a clean shutdown */
+static sqlite3 *deferred_check_db = NULL;
+static guint deferred_check_source = 0;
+
+/* a deferred check failed: don't claim the database is clean */
+static bool corruption_suspected = false;
+
+/* a clean marker exists for the running process, see smart_sql_mark_dirty() */
+static bool clean_marked = false;
+
 static bool
-_check_integrity(sqlite3 *db)
+_check_integrity(sqlite3 *db, bool quick)
 {
-    const char *cmd = "PRAGMA integrity_check;";
+    const char *cmd = quick ? "PRAGMA quick_check;" : "PRAGMA integrity_check;";
     int rc;
 
     sqlite3_stmt *stmt;
@@ -95,6 +115,56 @@ _check_integrity(sqlite3 *db)
     return returnValue;
 }
 
+/**
+* @brief Timed integrity check.
+*
+* @param  elapsed_ms receives the time spent in the check
+*/
+static bool
+_check_integrity_timed(sqlite3 *db, bool quick, int *elapsed_ms)
+{
+    gint64 start = g_get_monotonic_time();
+
+    bool retVal = _check_integrity(db, quick);
+
+    *elapsed_ms = (g_get_monotonic_time() - start) / 1000;
+
+    SLEEPDLOG_INFO(MSGID_DB_INTEGRITY_CHK_TIME, 2,
+                   PMLOGKS("Check", quick ? "quick_check" : "integrity_check"),
+                   PMLOGKFV("TimeMs", "%d", *elapsed_ms), "");
+
+    return retVal;
+}
+
+static gboolean
+_deferred_check(gpointer data)
+{
+    sqlite3 *db = data;
+
+    deferred_check_source = 0;
+    deferred_check_db = NULL;
+
+    if (!_check_integrity_timed(db, false, &check_stats.deferred_ms))
+    {
+        /* The database is in use by now, leave recovery to the next start,
+         * which will run the full check since no clean marker gets written. */
+        SLEEPDLOG_ERROR(MSGID_DB_INTEGRITY_CHK_ERR, 1,
+                        PMLOGKS(PATH, sqlite3_db_filename(db, "main")),
+                        "Db corrupted");
+        corruption_suspected = true;
+    }
+
+    check_stats.deferred_pending = false;
+
+    return FALSE;
+}
+
+static char *
+_clean_marker(const char *path)
+{
+    return g_strconcat(path, CLEAN_MARKER_SUFFIX, NULL);
+}
+
 bool
 smart_sql_exec(sqlite3 *db, const char *cmd)
 {
@@ -125,6 +195,123 @@ smart_sql_exec(sqlite3 *db, const char *cmd)
     return true;
 }
 
+/**
+* @brief Run a PRAGMA and copy out the first column of its result, if any.
+*
+* @retval false if the statement failed
+*/
+static bool
+_pragma(sqlite3 *db, const char *cmd, char **result)
+{
+    int rc;
+    sqlite3_stmt *stmt = NULL;
+
+    rc = sqlite3_prepare_v2(db, cmd, -1, &stmt, NULL);
+
+    if (!stmt)
+    {
+        SLEEPDLOG_WARNING(MSGID_SQLITE_PREPARE_ERR, 2, PMLOGKFV(ERRCODE, "%d", rc),
+                          PMLOGKS(COMMAND, cmd), "");
+        return false;
+    }
+
+    rc = sqlite3_step(stmt);
+
+    if (rc == SQLITE_ROW && result)
+    {
+        *result = g_strdup((const char *) sqlite3_column_text(stmt, 0));
+    }
+
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+        SLEEPDLOG_WARNING(MSGID_SQLITE_STEP_ERR, 2, PMLOGKFV(ERRCODE, "%d", rc),
+                          PMLOGKS(COMMAND, cmd), "");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+_is_one_of(const char *value, const char *const *allowed)
+{
+    for (; *allowed; allowed++)
+    {
+        if (g_ascii_strcasecmp(value, *allowed) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+* @brief Apply the [database] settings from sleepd.conf.
+*
+* Values that are not recognized are ignored and sqlite defaults are kept.
+*/
+static void
+_apply_profile(sqlite3 *db, const char *path)
+{
+    static const char *const journal_modes[] = { "wal", "memory", "delete", NULL };
+    static const char *const sync_levels[] = { "off", "normal", "full", NULL };
+    char *cmd;
+    char *mode = NULL;
+
+    if (_is_one_of(gSleepConfig.db_journal_mode, journal_modes))
+    {
+        cmd = g_strdup_printf("PRAGMA journal_mode = %s", gSleepConfig.db_journal_mode);
+
+        /* sqlite answers with the mode actually in use */
+        if (_pragma(db, cmd, &mode) &&
+                g_ascii_strcasecmp(mode ? : "", gSleepConfig.db_journal_mode) != 0)
+        {
+            SLEEPDLOG_WARNING(MSGID_SET_JOURNAL_MODE_ERR, 2,
+                              PMLOGKS("Requested", gSleepConfig.db_journal_mode),
+                              PMLOGKS(PATH, path), "journal mode not applied, using %s", mode);
+        }
+
+        g_free(mode);
+        g_free(cmd);
+    }
+    else
+    {
+        SLEEPDLOG_WARNING(MSGID_SET_JOURNAL_MODE_ERR, 1,
+                          PMLOGKS("Requested", gSleepConfig.db_journal_mode),
+                          "unknown journal mode");
+    }
+
+    if (_is_one_of(gSleepConfig.db_synchronous, sync_levels))
+    {
+        cmd = g_strdup_printf("PRAGMA synchronous = %s", gSleepConfig.db_synchronous);
+
+        if (!smart_sql_exec(db, cmd))
+        {
+            SLEEPDLOG_WARNING(MSGID_SET_SYNCOFF_ERR, 2, PMLOGKS(CAUSE,
+                              "Could not set synchronous on path"), PMLOGKS(PATH, path), "");
+        }
+
+        g_free(cmd);
+    }
+    else
+    {
+        SLEEPDLOG_WARNING(MSGID_SET_SYNCOFF_ERR, 1,
+                          PMLOGKS("Requested", gSleepConfig.db_synchronous),
+                          "unknown synchronous level");
+    }
+
+    cmd = g_strdup_printf("PRAGMA wal_autocheckpoint = %d",
+                          gSleepConfig.db_wal_autocheckpoint);
+    _pragma(db, cmd, NULL);
+    g_free(cmd);
+
+    cmd = g_strdup_printf("PRAGMA mmap_size = %d", gSleepConfig.db_mmap_size);
+    _pragma(db, cmd, NULL);
+    g_free(cmd);
+}
 
 static sqlite3 *
 _open(const char *path)
@@ -150,14 +337,7 @@ _open(const char *path)
     // TODO might want to enable sqlite3_palm_extension.so for
     // perf reasons.
 
-    // SyncOff
-    retVal = smart_sql_exec(db, "PRAGMA synchronous = 0");
-
-    if (!retVal)
-    {
-        SLEEPDLOG_WARNING(MSGID_SET_SYNCOFF_ERR, 2, PMLOGKS(CAUSE,
-                          "Could not set syncoff on path"), PMLOGKS(PATH, path), "");
-    }
+    _apply_profile(db, path);
 
     return db;
 }
@@ -172,6 +352,7 @@ bool
 smart_sql_open(const char *path, sqlite3 **ret_db)
 {
     bool retVal;
+    bool clean;
 
     sqlite3 *db  = _open(path);
 
@@ -180,7 +361,22 @@ smart_sql_open(const char *path, sqlite3 **ret_db)
         return false;
     }
 
-    retVal = _check_integrity(db);
+    /* The marker only vouches for the previous run, drop it before the
+     * database gets written to again. */
+    char *marker = _clean_marker(path);
+    clean = (remove(marker) == 0);
+    g_free(marker);
+
+    check_stats.clean_shutdown = clean;
+
+    if (clean)
+    {
+        retVal = _check_integrity_timed(db, true, &check_stats.quick_ms);
+    }
+    else
+    {
+        retVal = _check_integrity_timed(db, false, &check_stats.full_ms);
+    }
 
     if (!retVal)
     {
@@ -189,11 +385,14 @@ smart_sql_open(const char *path, sqlite3 **ret_db)
 
         _close(db);
 
-        char *journal = g_strdup_printf("%s-journal", path);
+        /* rollback journal, or write-ahead log and its index */
+        static const char *const journals[] = { "-journal", "-wal", "-shm", NULL };
 
-        if (journal != NULL)
+        for (const char *const *suffix = journals; *suffix; suffix++)
         {
-            if (remove(journal) != 0)
+            char *journal = g_strdup_printf("%s%s", path, *suffix);
+
+            if (remove(journal) != 0 && errno != ENOENT)
             {
                 SLEEPDLOG_WARNING(MSGID_JOURNAL_REMOVE_ERR, 1, PMLOGKS("FileName", journal),
                                   "Failed to remove corrupted db journal");
@@ -215,14 +414,127 @@ smart_sql_open(const char *path, sqlite3 **ret_db)
             return false;
         }
     }
+    else if (clean && !deferred_check_source)
+    {
+        /* finish the job once startup is over */
+        deferred_check_db = db;
+        deferred_check_source = g_idle_add_full(G_PRIORITY_LOW, _deferred_check, db,
+                                                NULL);
+        check_stats.deferred_pending = true;
+    }
 
     *ret_db = db;
     return true;
 }
 
+bool
+smart_sql_get_profile(sqlite3 *db, SmartSqlProfile *profile)
+{
+    char *value = NULL;
+
+    g_return_val_if_fail(profile != NULL, false);
+
+    memset(profile, 0, sizeof(*profile));
+
+    if (!db || !_pragma(db, "PRAGMA journal_mode", &value))
+    {
+        return false;
+    }
+
+    g_strlcpy(profile->journal_mode, value ? : "", sizeof(profile->journal_mode));
+    g_free(value);
+    value = NULL;
+
+    if (_pragma(db, "PRAGMA synchronous", &value) && value)
+    {
+        profile->synchronous = atoi(value);
+    }
+
+    g_free(value);
+    value = NULL;
+
+    if (_pragma(db, "PRAGMA wal_autocheckpoint", &value) && value)
+    {
+        profile->wal_autocheckpoint = atoi(value);
+    }
+
+    g_free(value);
+    value = NULL;
+
+    if (_pragma(db, "PRAGMA mmap_size", &value) && value)
+    {
+        profile->mmap_size = g_ascii_strtoll(value, NULL, 10);
+    }
+
+    g_free(value);
+    return true;
+}
+
+void
+smart_sql_mark_clean(sqlite3 *db)
+{
+    const char *path = db ? sqlite3_db_filename(db, "main") : NULL;
+
+    if (!path || corruption_suspected)
+    {
+        return;
+    }
+
+    char *marker = _clean_marker(path);
+
+    if (!g_file_set_contents(marker, "", 0, NULL))
+    {
+        SLEEPDLOG_DEBUG("Could not create %s", marker);
+    }
+    else
+    {
+        clean_marked = true;
+    }
+
+    g_free(marker);
+}
+
+void
+smart_sql_mark_dirty(sqlite3 *db)
+{
+    const char *path = db ? sqlite3_db_filename(db, "main") : NULL;
+
+    if (!clean_marked || !path)
+    {
+        return;
+    }
+
+    char *marker = _clean_marker(path);
+
+    /* the next open must not trust a database written after the marker */
+    if (remove(marker) != 0)
+    {
+        SLEEPDLOG_DEBUG("Could not remove %s", marker);
+    }
+
+    clean_marked = false;
+    g_free(marker);
+}
+
+void
+smart_sql_get_check_stats(SmartSqlCheckStats *stats)
+{
+    g_return_if_fail(stats != NULL);
+
+    *stats = check_stats;
+}
+
 void
 smart_sql_close(sqlite3 *db)
 {
+    if (deferred_check_db == db && deferred_check_source)
+    {
+        g_source_remove(deferred_check_source);
+        deferred_check_source = 0;
+        deferred_check_db = NULL;
+        check_stats.deferred_pending = false;
+    }
+
     _close(db);
 }
 
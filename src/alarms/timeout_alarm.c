@@ -33,7 +33,6 @@
 
 #include "main.h"
 #include "logging.h"
-#include "smartsql.h"
 
 #include "lunaservice_utils.h"
 #include "json_utils.h"
@@ -42,9 +41,13 @@
 #include "reference_time.h"
 
 #include "timeout_alarm.h"
+#include "timeout_queue.h"
+#include "timeout_store.h"
+#include "alarm_backend.h"
 #include "config.h"
 #include "init.h"
 #include "timesaver.h"
+#include "activity.h"
 
 #define LOG_DOMAIN "ALARMS-TIMEOUT: "
 
@@ -61,6 +64,9 @@
 #define TIMEOUT_MINIMUM_SEC (5)
 #define TIMEOUT_MINIMUM_AS_TEXT "5 seconds"
 
+#define REPEAT_DAILY_SEC  (24*60*60)
+#define REPEAT_WEEKLY_SEC (7*24*60*60)
+
 // keep the device on for at least 1s.
 #define TIMEOUT_KEEP_ALIVE_MS 1000
 
@@ -68,10 +74,7 @@
 
 #define STD_ASCTIME_BUF_SIZE    26
 
-// This allows testing the SQL commands to add the new columns. Set to false for production code
-#define CREATE_DB_WITHOUT_ACTIVITY_COLUMNS 0
-
-#define TIMEOUT_DATABASE_NAME "SysTimeouts.db"
+#define TIMEOUT_DRIFT_FILE_NAME "reference_drift"
 
 /* If next wakeup time exceeds 7 days its due to incorrect system time,
  * so set the minimum wakeup interval to 10 sec after which sleepd can
@@ -88,49 +91,39 @@ typedef enum
 } AlarmTimeoutType;
 
 static LSPalmService *psh = NULL, *pwebos_sh = NULL;
-static sqlite3 *timeout_db = NULL;
+static const TimeoutStore *store = NULL;
 static GTimerSource *sTimerCheck = NULL;
 static time_t invalid_time = (time_t) - 1;
 
-/*
-   Database Schema.
-
-   We use an sqlite3 database to store all pending events. The schema
-   is designed so that the event list can be quickly sorted and the
-   next item to fire can be quickly read.
-
-   expiry is the absolute system time of when the next event is to be
-   fired. It is GMT, so all math performed with it needs to be in GMT
-   as well.
-   */
-#if CREATE_DB_WITHOUT_ACTIVITY_COLUMNS
-static const char *kSysTimeoutDatabaseCreateSchema = "\
-CREATE TABLE IF NOT EXISTS AlarmTimeout (t1key INTEGER PRIMARY KEY,\
-                                         app_id TEXT,\
-                                         key TEXT,\
-                                         uri TEXT,\
-                                         params TEXT,\
-                                         public_bus INTEGER,\
-                                         wakeup   INTEGER,\
-                                         calendar INTEGER,\
-                                         expiry DATE);";
-#else
-static const char *kSysTimeoutDatabaseCreateSchema = "\
-CREATE TABLE IF NOT EXISTS AlarmTimeout (t1key INTEGER PRIMARY KEY,\
-                                         app_id TEXT,\
-                                         key TEXT,\
-                                         uri TEXT,\
-                                         params TEXT,\
-                                         public_bus INTEGER,\
-                                         wakeup   INTEGER,\
-                                         calendar INTEGER,\
-                                         expiry DATE,\
-                                         activity_id TEXT,\
-                                         activity_duration_ms INTEGER);";
-#endif
+/**
+* @brief Counters for the expiry pass.
+*/
+typedef struct
+{
+    unsigned long passes;          /*< _expire_timeouts() runs */
+    unsigned long expired_total;   /*< rows expired since start */
+    unsigned int  expired_last;    /*< rows expired by the last pass */
+    unsigned int  expired_max;     /*< most rows expired by one pass */
+} TimeoutExpiryStats;
+
+static TimeoutExpiryStats expiry_stats;
+
+/**
+* @brief RTC wakeups shared by windowed wakeup timeouts.
+*/
+typedef struct
+{
+    time_t        wake;           /*< RTC alarm armed by _queue_next_timeout() */
+    guint         covers;         /*< distinct expiry times due by 'wake' */
+
+    unsigned long shared;         /*< wakeups which fired more than one expiry time */
+    unsigned long saved;          /*< wakeups avoided by sharing */
+} TimeoutWakeStats;
 
-static const char *kSysTimeoutDatabaseCreateIndex = "\
-CREATE INDEX IF NOT EXISTS expiry_index on AlarmTimeout (expiry);";
+static TimeoutWakeStats wake_stats;
+
+/* timeouts refused by [alarms] max_timeouts_per_app */
+static unsigned long quota_rejected = 0;
 
 /**
  * @defgroup NewInterface   New interface
@@ -157,23 +150,78 @@ _print_timeout(const char *message, const char *app_id, const char *key,
 }
 
 static void _update_timeouts(void);
+static void _schedule_update_timeouts(void);
+static void _timeouts_changed(void);
 
 /**
-* @brief Called when a new alarm from the RTC is fired.
+* @brief Called when the wakeup alarm is fired.
 */
-static void _rtc_alarm_fired(nyx_device_handle_t handle,
-                             nyx_callback_status_t status, void *data)
+static void _rtc_alarm_fired(void)
 {
-    _update_timeouts();
+    _schedule_update_timeouts();
 }
 
 
+/**
+* @brief A fired timeout waiting for its bus call to be sent.
+*/
+typedef struct
+{
+    char *app_id;
+    char *key;
+    char *uri;
+    char *params;
+    bool  public_bus;
+} _PendingFire;
+
+/**
+* @brief Bus calls of fired timeouts.
+*
+* At most gSleepConfig.alarm_fire_concurrency calls are waiting for a reply at
+* any time; the rest wait here, grouped by application and sent one
+* application at a time so that a burst from one app can't starve the others.
+*/
+typedef struct
+{
+    GHashTable *per_app;        /*< app_id -> GQueue of _PendingFire */
+    GQueue     *apps;           /*< app_ids with pending calls, in turn order */
+    guint       pending;
+    guint       in_flight;
+    bool        awake;          /*< holding FIRE_QUEUE_ACTIVITY_ID */
+
+    /* counters */
+    unsigned long sent;
+    unsigned long replies;
+    guint         max_pending;
+    gint64        latency_total_us;
+    gint64        latency_max_us;
+} _FireQueue;
+
+static _FireQueue fire_queue;
+
+/* keeps the device awake until the fire queue has drained */
+#define FIRE_QUEUE_ACTIVITY_ID "com.webos.service.alarm.fire_queue"
+
+static void _fire_queue_pump(void);
+
+static void
+_pending_fire_free(_PendingFire *fire)
+{
+    g_free(fire->app_id);
+    g_free(fire->key);
+    g_free(fire->uri);
+    g_free(fire->params);
+    g_free(fire);
+}
+
 /**
 * @brief Response to timeout message.
 *
+* Also called by LS2 with an error message if the reply timed out.
+*
 * @param  sh
 * @param  msg
-* @param  ctx
+* @param  ctx  monotonic time the call was sent
 *
 * @retval
 */
@@ -181,6 +229,29 @@ static bool
 _timeout_response(LSHandle *sh, LSMessage *message, void *ctx)
 {
     struct json_object *object;
+    gint64 *sent_us = ctx;
+
+    if (sent_us)
+    {
+        gint64 latency = g_get_monotonic_time() - *sent_us;
+
+        fire_queue.replies++;
+        fire_queue.latency_total_us += latency;
+
+        if (latency > fire_queue.latency_max_us)
+        {
+            fire_queue.latency_max_us = latency;
+        }
+
+        g_free(sent_us);
+
+        if (fire_queue.in_flight)
+        {
+            fire_queue.in_flight--;
+        }
+
+        _fire_queue_pump();
+    }
 
     object = json_tokener_parse(LSMessageGetPayload(message));
 
@@ -216,52 +287,23 @@ cleanup:
 }
 
 /**
-* @brief Send a message to the (uri, params) associated with the timeout.
+* @brief Send a message to the (uri, params) associated with a fired timeout.
 *
-* @param  timeout
+* @retval true if a reply is outstanding
 */
-static void
-_timeout_fire(_AlarmTimeout *timeout)
+static bool
+_fire_send(_PendingFire *fire)
 {
-    g_return_if_fail(timeout_db != NULL);
-    g_return_if_fail(timeout != NULL);
-    GString *payload = g_string_new("");
-
-    SLEEPDLOG_DEBUG("_timeout_fire : %s (%s => %s)", timeout->app_id,
-                    timeout->key, timeout->uri);
+    SLEEPDLOG_DEBUG("_timeout_fire : %s (%s => %s)", fire->app_id,
+                    fire->key, fire->uri);
 
     LSHandle *sh = NULL;
     bool retVal;
+    LSMessageToken token;
     LSError lserror;
     LSErrorInit(&lserror);
 
-    sh = GetWebosLunaServiceHandle();
-
-    /* Give system some time to process this timeout before
-     * going to sleep again. The client can provide a specific
-     * activity ID and duration. Otherwise we use a common default.
-     */
-    if (
-        timeout->activity_id && strlen(timeout->activity_id) &&
-        0 != timeout->activity_duration_ms
-    )
-    {
-        g_string_append_printf(payload,
-                               "{\"id\":\"%s\","
-                               "\"duration_ms\":%d}", timeout->activity_id, timeout->activity_duration_ms);
-    }
-    else
-    {
-        g_string_append_printf(payload,
-                               "{\"id\":\"%s\","
-                               "\"duration_ms\":%d}", DEFAULT_ACTIVITY_ID, TIMEOUT_KEEP_ALIVE_MS);
-    }
-
-    LSCallOneReply(sh, "palm://com.webos.service.power/suspend/activityStart",
-                   payload->str, NULL, NULL, NULL, NULL);
-
-
-    if (timeout->public_bus)
+    if (fire->public_bus)
     {
         sh = LSPalmServiceGetPublicConnection(pwebos_sh);
     }
@@ -270,200 +312,316 @@ _timeout_fire(_AlarmTimeout *timeout)
         sh = LSPalmServiceGetPrivateConnection(pwebos_sh);
     }
 
+    gint64 *sent_us = g_new(gint64, 1);
+    *sent_us = g_get_monotonic_time();
+
     // Call Luna-service bus with the uri/params.
     retVal = LSCallFromApplicationOneReply(sh,
-                                           timeout->uri, timeout->params, timeout->app_id,
-                                           _timeout_response, NULL, NULL, &lserror);
+                                           fire->uri, fire->params, fire->app_id,
+                                           _timeout_response, sent_us, &token, &lserror);
 
     if (!retVal)
     {
-        SLEEPDLOG_DEBUG("_timeout_fire() : Could not send (%s %s): %s", timeout->uri,
-                        timeout->params, lserror.message);
+        SLEEPDLOG_DEBUG("_timeout_fire() : Could not send (%s %s): %s", fire->uri,
+                        fire->params, lserror.message);
         LSErrorFree(&lserror);
+        g_free(sent_us);
+        return false;
     }
 
-    g_string_free(payload, TRUE);
+    /* a target that never answers must not keep its slot */
+    if (!LSCallSetTimeout(sh, token, gSleepConfig.alarm_fire_timeout_ms, &lserror))
+    {
+        LSErrorFree(&lserror);
+    }
+
+    fire_queue.sent++;
+
+    return true;
 }
 
-bool _sql_step_finalize(const char *func, sqlite3_stmt *st)
+/**
+* @brief Send pending calls while below the concurrency limit.
+*/
+static void
+_fire_queue_pump(void)
 {
-    int rc;
-
-    rc = sqlite3_step(st);
+    guint limit = MAX(gSleepConfig.alarm_fire_concurrency, 1);
 
-    if (rc != SQLITE_DONE)
+    while (fire_queue.pending && fire_queue.in_flight < limit)
     {
-        SLEEPDLOG_WARNING(MSGID_SQLITE_STEP_FAIL, 1, PMLOGKFV(ERRCODE, "%d", rc), "");
-                sqlite3_finalize(st);
-        return false;
-    }
+        char *app = g_queue_pop_head(fire_queue.apps);
+        GQueue *calls = g_hash_table_lookup(fire_queue.per_app, app);
+        _PendingFire *fire = g_queue_pop_head(calls);
 
-    rc = sqlite3_finalize(st);
+        fire_queue.pending--;
 
-    if (rc != SQLITE_OK)
-    {
-        SLEEPDLOG_WARNING(MSGID_SQLITE_FINALIZE_FAIL, 1, PMLOGKFV(ERRCODE, "%d", rc),
-                          "");
-        return false;
+        if (g_queue_is_empty(calls))
+        {
+            /* also frees 'app' */
+            g_hash_table_remove(fire_queue.per_app, app);
+        }
+        else
+        {
+            g_queue_push_tail(fire_queue.apps, app);
+        }
+
+        if (_fire_send(fire))
+        {
+            fire_queue.in_flight++;
+        }
+
+        _pending_fire_free(fire);
     }
 
-    return true;
+    if (fire_queue.pending || fire_queue.in_flight)
+    {
+        /* renewed on every reply, so it still lapses if replies stop coming */
+        PwrEventActivityStart(FIRE_QUEUE_ACTIVITY_ID,
+                              gSleepConfig.alarm_fire_timeout_ms + TIMEOUT_KEEP_ALIVE_MS);
+        fire_queue.awake = true;
+    }
+    else if (fire_queue.awake)
+    {
+        PwrEventActivityStop(FIRE_QUEUE_ACTIVITY_ID);
+        fire_queue.awake = false;
+    }
 }
 
 /**
-* @brief Adjusts all relative (non-calendar alarms) by the delta amount.
+* @brief Note the activity a fired timeout wants held while it is handled.
 *
-* @param  delta
+* Give system some time to process this timeout before going to sleep
+* again. The client can provide a specific activity ID and duration.
+* Otherwise we use a common default.
+*
+* @param  keep_alive  activity_id -> longest duration_ms in this pass
+* @param  timeout
 */
 static void
-_recalculate_timeouts(time_t delta)
+_timeout_keep_alive(GHashTable *keep_alive, const _AlarmTimeout *timeout)
 {
-    PMLOG_TRACE("delta = %ld", delta);
+    const char *id = DEFAULT_ACTIVITY_ID;
+    int duration_ms = TIMEOUT_KEEP_ALIVE_MS;
 
-    if (delta)
+    if (timeout->activity_id && strlen(timeout->activity_id) &&
+            0 != timeout->activity_duration_ms)
     {
+        id = timeout->activity_id;
+        duration_ms = timeout->activity_duration_ms;
+    }
 
-        int rc;
-        char **table;
-        int noRows, noCols;
-        char *zErrMsg;
-        int i;
+    gpointer held = g_hash_table_lookup(keep_alive, id);
 
-        /* Find all relative (non-calendar alarms) */
-        const char *sqlquery =
-            "SELECT t1key,expiry FROM AlarmTimeout WHERE calendar=0";
+    if (!held || GPOINTER_TO_INT(held) < duration_ms)
+    {
+        g_hash_table_insert(keep_alive, g_strdup(id), GINT_TO_POINTER(duration_ms));
+    }
+}
 
-        rc = sqlite3_get_table(timeout_db, sqlquery,
-                               &table, &noRows, &noCols, &zErrMsg);
+/**
+* @brief Start the activities collected by _timeout_keep_alive().
+*
+* Called in-process rather than through our own activityStart method. All
+* timeouts of a pass sharing an activity ID (by default, all of them) take
+* a single activity for the longest duration requested: starting the same
+* ID again would replace it, possibly with a shorter one.
+*/
+static void
+_timeout_keep_alive_start(GHashTable *keep_alive)
+{
+    GHashTableIter iter;
+    gpointer id, duration_ms;
 
-        if (SQLITE_OK != rc)
-        {
-            SLEEPDLOG_WARNING(MSGID_EXPIRY_SELECT_FAIL, 2, PMLOGKS(ERRTEXT, zErrMsg),
-                              PMLOGKFV(ERRCODE, "%d", rc), "");
-            sqlite3_free(zErrMsg);
-            return;
-        }
+    g_hash_table_iter_init(&iter, keep_alive);
 
-        int base = 0;
+    while (g_hash_table_iter_next(&iter, &id, &duration_ms))
+    {
+        PwrEventActivityStart(id, GPOINTER_TO_INT(duration_ms));
+    }
+}
 
-        for (i = 0; i < noRows; i++)
-        {
+/**
+* @brief Queue the message of a fired timeout, see _fire_queue_pump().
+*
+* @param  timeout  copied, may point into a statement row
+*/
+static void
+_timeout_fire(_AlarmTimeout *timeout)
+{
+    g_return_if_fail(store != NULL);
+    g_return_if_fail(timeout != NULL);
+
+    if (!fire_queue.per_app)
+    {
+        fire_queue.per_app = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                             (GDestroyNotify)g_queue_free);
+        fire_queue.apps = g_queue_new();
+    }
 
-            base += noCols;
-            const char *table_id = table[base];
-            const char *expiry = table[base + 1];
+    _PendingFire *fire = g_new0(_PendingFire, 1);
+    fire->app_id = g_strdup(timeout->app_id);
+    fire->key = g_strdup(timeout->key);
+    fire->uri = g_strdup(timeout->uri);
+    fire->params = g_strdup(timeout->params);
+    fire->public_bus = timeout->public_bus;
 
-            time_t new_expiry = atoi(expiry) + delta;
+    const char *app = timeout->app_id ? : "";
+    GQueue *calls = g_hash_table_lookup(fire_queue.per_app, app);
 
-            /* Delete the timeout.*/
-            sqlite3_stmt *st = NULL;
-            const char *tail;
-            rc = sqlite3_prepare_v2(timeout_db,
-                                    "UPDATE AlarmTimeout SET expiry=$1 WHERE t1key=$2",
-                                    -1, &st, &tail);
+    if (!calls)
+    {
+        char *app_key = g_strdup(app);
 
-            if (rc != SQLITE_OK)
-            {
-                SLEEPDLOG_WARNING(MSGID_UPDATE_EXPIRY_FAIL, 0, "cannot update expiry");
-            }
-            else
-            {
-                rc = sqlite3_bind_int(st, 1, new_expiry);
-                rc = sqlite3_bind_int(st, 2, atoi(table_id));
-                _sql_step_finalize(__func__, st);
-            }
-        }
+        calls = g_queue_new();
+        g_hash_table_insert(fire_queue.per_app, app_key, calls);
+        g_queue_push_tail(fire_queue.apps, app_key);
+    }
+
+    g_queue_push_tail(calls, fire);
+    fire_queue.pending++;
 
-        sqlite3_free_table(table);
+    if (fire_queue.pending > fire_queue.max_pending)
+    {
+        fire_queue.max_pending = fire_queue.pending;
     }
 }
 
 /**
-* @brief Trigger all expired timeouts.
+* @brief Follow a system time change.
+*
+* Relative timeouts are stored in relative time, so only the offset used to
+* turn them into wall time changes.
+*
+* @param  delta
 */
 static void
-_expire_timeouts(void)
+_recalculate_timeouts(time_t delta)
 {
-    int rc;
-    char **table;
-    int noRows, noCols;
-    char *zErrMsg;
-    int i;
-    time_t now;
-    int base;
-    _AlarmTimeout timeout;
+    PMLOG_TRACE("delta = %ld", delta);
 
-    now = reference_time();
+    timeout_queue_set_drift(reference_drift());
+}
+
+/**
+* @brief State of one expiry pass.
+*/
+typedef struct
+{
+    time_t      now;
+    time_t      now_relative;
+    GHashTable *keep_alive;         /*< see _timeout_keep_alive() */
+    unsigned int expired;
+    guint       wakeup_times;       /*< distinct expiry times of wakeup timeouts */
+    time_t      last_wakeup_time;
+} _ExpiryPass;
 
-    /* Find all expired calendar timeouts */
-    char *sqlquery = g_strdup_printf(
-                         "SELECT t1key,app_id,key,uri,params,public_bus,activity_id,activity_duration_ms FROM AlarmTimeout "
-                         "WHERE expiry<=%ld ORDER BY expiry", now);
+/**
+* @brief Fire one expired timeout, called by the store for each of them in
+*        wall time order.
+*/
+static void
+_timeout_expired(const _AlarmTimeout *stored, void *data)
+{
+    _ExpiryPass *pass = data;
+    _AlarmTimeout timeout = *stored;
+    time_t wall_expiry = timeout.calendar ? timeout.expiry :
+                         timeout.expiry + (pass->now - pass->now_relative);
 
-    rc = sqlite3_get_table(timeout_db, sqlquery,
-                           &table, &noRows, &noCols, &zErrMsg);
+    /* called back without an app id if it was set without one */
+    if (timeout.app_id && !*timeout.app_id)
+    {
+        timeout.app_id = NULL;
+    }
 
-    g_free(sqlquery);
+    /* Fire timeout */
+    _timeout_keep_alive(pass->keep_alive, &timeout);
+    _timeout_fire(&timeout);
 
-    if (SQLITE_OK != rc)
+    if (timeout.wakeup &&
+            (!pass->wakeup_times || wall_expiry != pass->last_wakeup_time))
     {
-        SLEEPDLOG_WARNING(MSGID_SELECT_EXPIRED_TIMEOUT, 2, PMLOGKS(ERRTEXT, zErrMsg),
-                          PMLOGKFV(ERRCODE, "%d", rc), "");
-        sqlite3_free(zErrMsg);
-        return;
+        pass->wakeup_times++;
+        pass->last_wakeup_time = wall_expiry;
     }
 
-    for (i = 0, base = 0; i < noRows; i++)
+    if (timeout.repeat > 0)
+    {
+        timeout_queue_put(stored->app_id, timeout.key, timeout.public_bus,
+                          timeout.wakeup, timeout.calendar,
+                          timeout_next_repeat(timeout.expiry, timeout.repeat,
+                                              timeout.calendar ? pass->now : pass->now_relative),
+                          timeout.window);
+    }
+    else
+    {
+        timeout_queue_remove(stored->app_id, timeout.key, timeout.public_bus);
+    }
+
+    pass->expired++;
+}
+
+/**
+* @brief Trigger all expired timeouts.
+*
+* One-shot timeouts are deleted, repeating timeouts are moved to their next
+* period in place.
+*/
+static void
+_expire_timeouts(void)
+{
+    _ExpiryPass pass = { 0 };
+    unsigned int expired;
+
+    if (!store)
     {
+        return;
+    }
 
-        base += noCols;
+    pass.keep_alive = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    pass.now = reference_time();
+    pass.now_relative = relative_time();
 
-        timeout.table_id = table[base];
-        timeout.app_id = table[base + 1];
-        timeout.key = table[base + 2];
-        timeout.uri = table[base + 3];
-        timeout.params = table[base + 4];
-        timeout.public_bus = atoi(table[base + 5]);
+    store->scan_due(pass.now, pass.now_relative, _timeout_expired, &pass);
 
-        /*
-          If we have an upgraded db where the activity_id and activity_duration_ms columns were
-          added and there were existing rows then these two fields will return NULL.
-        */
-        if (!table[base + 6] || !table[base + 7])
-        {
-            SLEEPDLOG_DEBUG("null activity_id or activity_duration_ms fields for \"%s\":\"%s\"",
-                            timeout.app_id, timeout.key);
-        }
+    expired = pass.expired;
 
-        timeout.activity_id =
-            table[base + 6]; // _timeout_fire can handle a null activity_id
-        timeout.activity_duration_ms = table[base + 7] ? atoi(table[base + 7]) :
-                                       0; // _timeout_fire will fill-in the default duration
+    _timeout_keep_alive_start(pass.keep_alive);
+    g_hash_table_destroy(pass.keep_alive);
 
-        /* Fire timeout */
-        _timeout_fire(&timeout);
+    /* send what this pass fired, within the concurrency limit */
+    _fire_queue_pump();
 
-        /* Delete the timeout.*/
-        sqlite3_stmt *st = NULL;
-        const char *tail;
-        rc = sqlite3_prepare_v2(timeout_db,
-                                "DELETE FROM AlarmTimeout WHERE t1key=$1", -1, &st, &tail);
+    /* Each expiry time beyond the first that the armed wakeup served would
+     * have needed an RTC wakeup of its own. */
+    if (wake_stats.wake && pass.now >= wake_stats.wake)
+    {
+        guint served = MIN(pass.wakeup_times, wake_stats.covers);
 
-        if (rc == SQLITE_OK)
-        {
-            rc = sqlite3_bind_int(st, 1, atoi(timeout.table_id));
-            _sql_step_finalize(__func__, st);
-        }
-        else
+        if (served > 1)
         {
-            SLEEPDLOG_WARNING(MSGID_SQLITE_PREPARE_FAIL, 1, PMLOGKFV(ERRCODE, "%d", rc),
-                              "");
+            wake_stats.shared++;
+            wake_stats.saved += served - 1;
         }
+
+        wake_stats.wake = 0;
     }
 
-    sqlite3_free_table(table);
-}
+    expiry_stats.passes++;
+    expiry_stats.expired_last = expired;
+    expiry_stats.expired_total += expired;
+
+    if (expired > expiry_stats.expired_max)
+    {
+        expiry_stats.expired_max = expired;
+    }
 
+    if (expired)
+    {
+        SLEEPDLOG_DEBUG("expired %u timeouts", expired);
+        _timeouts_changed();
+    }
+}
 
 bool
 timeout_get_next_wakeup(time_t *expiry, gchar **app_id, gchar **key)
@@ -471,45 +629,34 @@ timeout_get_next_wakeup(time_t *expiry, gchar **app_id, gchar **key)
     g_return_val_if_fail(expiry != NULL, false);
     g_return_val_if_fail(app_id != NULL, false);
     g_return_val_if_fail(key != NULL, false);
-    bool ret = false;
 
-    char **table;
-    int noRows, noCols;
-    char *zErrMsg;
-    int rc;
-    time_t now = reference_time();
+    return timeout_queue_next_wake(reference_time(), expiry, NULL, app_id, key);
+}
 
-        char *sqlquery = g_strdup_printf(
-                             "SELECT expiry, app_id, key FROM AlarmTimeout "
-                             "WHERE wakeup=1 AND expiry >%ld ORDER BY expiry LIMIT 1", now);
-        if (!sqlquery)
-        {
-            SLEEPDLOG_WARNING(MSGID_ALARM_TIMEOUT_SELECT, 0, "SQL query not formed");
-            return false;
-        }
+static void
+_timeout_queue_put(const _AlarmTimeout *timeout, void *data)
+{
+    timeout_queue_put(timeout->app_id, timeout->key, timeout->public_bus,
+                      timeout->wakeup, timeout->calendar, timeout->expiry,
+                      timeout->window);
+}
 
-        rc = sqlite3_get_table(timeout_db, sqlquery, &table, &noRows, &noCols, &zErrMsg);
-        g_free(sqlquery);
+/**
+* @brief Mirror all stored timeouts into the in-memory timeout queue.
+*/
+static bool
+_timeout_queue_load(void)
+{
+    timeout_queue_init();
+    timeout_queue_set_drift(reference_drift());
 
-    if (rc != SQLITE_OK)
+    if (!store->scan_all(_timeout_queue_put, NULL))
     {
-        SLEEPDLOG_WARNING(MSGID_SELECT_EXPIRY_ERR, 2, PMLOGKS(ERRTEXT, zErrMsg),
-                          PMLOGKFV(ERRCODE, "%d", rc),
-                          "Failed to select expiry from timeout db");
-        sqlite3_free(zErrMsg);
         return false;
     }
 
-    if (noRows)
-    {
-        *expiry = atol(table[ noCols ]);
-        *app_id = g_strdup(table[ noCols + 1 ]);
-        *key = g_strdup(table[ noCols + 2 ]);
-        ret = true;
-    }
-
-    sqlite3_free_table(table);
-    return ret;
+    SLEEPDLOG_DEBUG("loaded %u timeouts", timeout_queue_size());
+    return true;
 }
 
 /**
@@ -531,96 +678,51 @@ timeout_get_next_wakeup(time_t *expiry, gchar **app_id, gchar **key)
 static bool
 _queue_next_timeout(bool set_callback_fn)
 {
-    int rc;
-    char **table;
-    int noRows, noCols;
-    char *zErrMsg;
-
     time_t rtc_expiry = 0;
     time_t timer_expiry = 0;
     time_t now = reference_time(); // TODO wall clock? or RTC?
+    guint covers = 0;
+    bool has_wakeup, has_timer;
+    bool rtc_armed = false;
 
-    g_return_val_if_fail(timeout_db != NULL, false);
-
-        char *sqlquery = g_strdup_printf(
-                             "SELECT expiry FROM AlarmTimeout "
-                             "WHERE wakeup=1 AND expiry >%ld ORDER BY expiry LIMIT 1", now);
-        if (!sqlquery)
-        {
-            SLEEPDLOG_WARNING(MSGID_ALARM_TIMEOUT_SELECT, 0, "SQL query not formed");
-            return false;
-        }
-
-        rc = sqlite3_get_table(timeout_db, sqlquery, &table, &noRows, &noCols, &zErrMsg);
-        g_free(sqlquery);
+    g_return_val_if_fail(store != NULL, false);
 
-    if (rc != SQLITE_OK)
-    {
-        SLEEPDLOG_WARNING(MSGID_SELECT_EXPIRY_WITH_WAKEUP, 2, PMLOGKS(ERRTEXT, zErrMsg),
-                          PMLOGKFV(ERRCODE, "%d", rc), "");
-        sqlite3_free(zErrMsg);
-        return false;
-    }
+    /* windowed wakeup timeouts share the wakeup of the earliest deadline */
+    has_wakeup = timeout_queue_next_wake(now, &rtc_expiry, &covers, NULL, NULL);
 
-    if (!noRows)
+    if (!has_wakeup)
     {
-        nyx_system_set_alarm(GetNyxSystemDevice(), 0, NULL, NULL);
+        wake_stats.wake = 0;
+        alarm_backend_set(0, false);
     }
     else
     {
-        rtc_expiry = atol(table[ noCols ]);
+        wake_stats.wake = rtc_expiry;
+        wake_stats.covers = covers;
 
-        // Callback function is unnecessary, because timer checks alarm time.
-        // For callback function, nyx-modules uses glib watch function.
-        // This makes problem that Luns Service API is blocked.
-        // nyx_system_set_alarm(GetNyxSystemDevice(), to_rtc(rtc_expiry), NULL, NULL);
-        nyx_error_t nyx_error = nyx_system_set_alarm(GetNyxSystemDevice(), rtc_expiry,
-                                set_callback_fn ? _rtc_alarm_fired : NULL,
-                                NULL);
-
-        if (nyx_error != NYX_ERROR_NONE)
-        {
-            // In case we get an error in setting RTC alarm, we just fall through to set
-            // a regular g_timer timeout.
-            SLEEPDLOG_DEBUG("Failed to setup RTC wakeup alarm: %d", nyx_error);
-        }
-        else
-        {
-            sqlite3_free_table(table);
-            return true;
-        }
+        // In case we get an error in setting RTC alarm, we just fall through to set
+        // a regular g_timer timeout.
+        rtc_armed = alarm_backend_set(rtc_expiry, set_callback_fn);
     }
 
-    sqlite3_free_table(table);
-
-        sqlquery = g_strdup_printf(
-                             "SELECT expiry FROM AlarmTimeout "
-                             "WHERE expiry >%ld ORDER BY expiry LIMIT 1", now);
-        if (!sqlquery)
-        {
-            SLEEPDLOG_WARNING(MSGID_ALARM_TIMEOUT_SELECT, 0, "SQL query not formed");
-            return false;
-        }
-
-        rc = sqlite3_get_table(timeout_db, sqlquery, &table, &noRows, &noCols, &zErrMsg);
-        g_free(sqlquery);
+    /* The timer follows the next non-wakeup timeout, taken from the timing
+     * wheel, and the next wakeup timeout as well if the RTC could not be
+     * armed. With nothing to wait for it only rechecks the time once in
+     * MAX_WAKEUP_SECS. */
+    has_timer = timeout_queue_next_timer(now, &timer_expiry);
 
-    if (rc != SQLITE_OK)
+    if (has_wakeup && !rtc_armed && (!has_timer || rtc_expiry < timer_expiry))
     {
-        SLEEPDLOG_WARNING(MSGID_ALARM_TIMEOUT_SELECT, 2, PMLOGKS(ERRTEXT, zErrMsg),
-                          PMLOGKFV(ERRCODE, "%d", rc), "");
-        sqlite3_free(zErrMsg);
-        return false;
+        timer_expiry = rtc_expiry;
+        has_timer = true;
     }
 
-    if (!noRows)
+    if (!has_timer)
     {
-        g_timer_source_set_interval_seconds(sTimerCheck, 60 * 60, true);
+        g_timer_source_set_interval_seconds(sTimerCheck, MAX_WAKEUP_SECS, true);
     }
     else
     {
-        timer_expiry = atol(table[ noCols ]);
-
         long wakeInSeconds = timer_expiry - now;
 
         if (wakeInSeconds < 0)
@@ -635,7 +737,6 @@ _queue_next_timeout(bool set_callback_fn)
         g_timer_source_set_interval_seconds(sTimerCheck, wakeInSeconds, true);
     }
 
-    sqlite3_free_table(table);
     return true;
 }
 
@@ -644,19 +745,45 @@ bool queue_next_wakeup()
     return _queue_next_timeout(true);
 }
 
+/* set when reference_time_watch() reports clock changes, otherwise every
+ * update polls for them */
+static bool clock_watched = false;
+
+/**
+* @brief Follow a system time change in both alarm interfaces.
+*/
+static void
+_follow_time_change(time_t delta)
+{
+    _recalculate_timeouts(delta);
+    void update_alarms_delta(time_t delta);
+    update_alarms_delta(delta);
+}
+
+/**
+* @brief Called from the clock watch when system time was set.
+*/
+static void
+_clock_changed(time_t delta)
+{
+    _follow_time_change(delta);
+    _schedule_update_timeouts();
+}
+
 /**
 * @brief Trigger expired timeouts, and queue up the next one.
 */
 static void
 _update_timeouts(void)
 {
-    time_t delta = update_reference_time(NULL, NULL);
-
-    if (delta != invalid_time && delta != 0)
+    if (!clock_watched)
     {
-        _recalculate_timeouts(delta);
-        void update_alarms_delta(time_t delta);
-        update_alarms_delta(delta);
+        time_t delta = update_reference_time(NULL, NULL);
+
+        if (delta != invalid_time && delta != 0)
+        {
+            _follow_time_change(delta);
+        }
     }
 
     _expire_timeouts();
@@ -664,19 +791,124 @@ _update_timeouts(void)
     _queue_next_timeout(true);
 }
 
-void _timeout_create(_AlarmTimeout *timeout,
-                     const char *app_id, const char *key,
-                     const char *uri, const char *params,
-                     bool public_bus, bool wakeup,
-                     const char *activity_id,
-                     int activity_duration_ms,
-                     bool calendar, time_t expiry)
+/**
+* @brief Run 'func' once from the main loop unless it is already pending.
+*
+* @param  source_id  holds the pending source, func must reset it to 0
+*
+* @retval false if func was already pending
+*/
+static bool
+_idle_once(guint *source_id, GSourceFunc func)
 {
-    g_return_if_fail(timeout != NULL);
+    if (*source_id)
+    {
+        return false;
+    }
 
-    timeout->app_id = app_id;
-    timeout->key = key;
-    timeout->uri = uri;
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, func, NULL, NULL);
+    *source_id = g_source_attach(source, GetMainLoopContext());
+    g_source_unref(source);
+
+    return true;
+}
+
+/* Pending idle dispatch of _update_timeouts(), see _schedule_update_timeouts() */
+static guint update_timeouts_source = 0;
+
+/**
+* @brief Counters for deferred _update_timeouts() calls.
+*/
+typedef struct
+{
+    unsigned long requested;    /*< _schedule_update_timeouts() calls */
+    unsigned long coalesced;    /*< requests folded into a pending run */
+    unsigned long ran;          /*< _update_timeouts() runs from idle */
+} TimeoutUpdateStats;
+
+static TimeoutUpdateStats update_stats;
+
+static gboolean
+_update_timeouts_idle(gpointer data)
+{
+    update_timeouts_source = 0;
+    update_stats.ran++;
+
+    _update_timeouts();
+
+    return FALSE;
+}
+
+/**
+* @brief Request _update_timeouts() from the main loop.
+*
+* Runs once after all pending higher-priority events (e.g. a burst of bus
+* messages) have been handled, however many times it was requested.
+*/
+static void
+_schedule_update_timeouts(void)
+{
+    update_stats.requested++;
+
+    if (!_idle_once(&update_timeouts_source, _update_timeouts_idle))
+    {
+        update_stats.coalesced++;
+    }
+}
+
+#define TIMEOUT_LIST_SUBSCRIPTION "timeoutList"
+
+/* Pending change notification to timeout/list subscribers */
+static guint list_notify_source = 0;
+
+static gboolean
+_notify_list_changed_idle(gpointer data)
+{
+    const char *payload = "{\"returnValue\":true,\"changed\":true}";
+    LSError lserror;
+    LSErrorInit(&lserror);
+
+    list_notify_source = 0;
+
+    /* timeout/list is a private method, so all of its subscriptions are
+     * kept on the private connection */
+    if (!LSSubscriptionReply(LSPalmServiceGetPrivateConnection(pwebos_sh),
+                             TIMEOUT_LIST_SUBSCRIPTION, payload, &lserror))
+    {
+        LSErrorPrint(&lserror, stderr);
+        LSErrorFree(&lserror);
+    }
+
+    return FALSE;
+}
+
+/**
+* @brief Tell timeout/list subscribers, once per main loop iteration, that
+*        the set of pending timeouts changed.
+*/
+static void
+_timeouts_changed(void)
+{
+    if (pwebos_sh)
+    {
+        _idle_once(&list_notify_source, _notify_list_changed_idle);
+    }
+}
+
+void _timeout_create(_AlarmTimeout *timeout,
+                     const char *app_id, const char *key,
+                     const char *uri, const char *params,
+                     bool public_bus, bool wakeup,
+                     const char *activity_id,
+                     int activity_duration_ms,
+                     bool calendar, time_t expiry)
+{
+    g_return_if_fail(timeout != NULL);
+
+    timeout->app_id = app_id;
+    timeout->key = key;
+    timeout->uri = uri;
     timeout->params = params;
     timeout->public_bus = public_bus;
     timeout->wakeup = wakeup;
@@ -684,55 +916,170 @@ void _timeout_create(_AlarmTimeout *timeout,
     timeout->activity_duration_ms = activity_duration_ms;
     timeout->calendar = calendar;
     timeout->expiry = expiry;
+    timeout->window = 0;
+    timeout->repeat = 0;
 }
 
-bool
-_timeout_set(_AlarmTimeout *timeout)
+static time_t
+_timeout_wall_expiry(bool calendar, time_t expiry)
 {
-    int rc;
-    sqlite3_stmt *st = NULL;
-    const char *tail;
+    return calendar ? expiry : expiry + reference_drift();
+}
 
-    g_return_val_if_fail(timeout != NULL, false);
+/**
+* @brief Write a timeout to the store and the timeout queue without
+*        touching the schedule.
+*
+* @param  timeout
+* @param  keep_existing if true an existing timeout is left untouched
+* @param  kept_existing if not NULL set to true when an existing timeout was
+*         left untouched
+*
+* @retval false if the database could not be updated
+*/
+static bool
+_timeout_store(_AlarmTimeout *timeout, bool keep_existing, bool *kept_existing)
+{
+    const char *app_id;
+    bool kept;
 
-    /* Delete (app_id,key,public_bus) if it already exists */
-    _timeout_delete(timeout->app_id, timeout->key, timeout->public_bus);
+    g_return_val_if_fail(timeout != NULL, false);
 
-    rc = sqlite3_prepare_v2(timeout_db,
-                            "INSERT INTO AlarmTimeout (app_id,key,uri,params,public_bus,wakeup,calendar,expiry,activity_id,activity_duration_ms) "
-                            "VALUES ( $1, $2, $3, $4, $5, $6, $7, $8, $9, $10 )", -1, &st, &tail);
+    app_id = timeout->app_id ? : "";
 
-    if (rc != SQLITE_OK)
+    if (!store || !store->put(timeout, keep_existing, &kept))
     {
-        SLEEPDLOG_WARNING(MSGID_ALARM_TIMEOUT_INSERT, 1, PMLOGKFV(ERRCODE, "%d", rc),
+        SLEEPDLOG_WARNING(MSGID_ALARM_TIMEOUT_INSERT, 0,
                           "Insert into AlarmTimeout failed");
         return false;
     }
 
-    sqlite3_bind_text(st,  1, timeout->app_id,
-                      timeout->app_id ? strlen(timeout->app_id) : -1, SQLITE_STATIC);
-    sqlite3_bind_text(st,  2, timeout->key, strlen(timeout->key), SQLITE_STATIC);
-    sqlite3_bind_text(st,  3, timeout->uri, strlen(timeout->uri), SQLITE_STATIC);
-    sqlite3_bind_text(st,  4, timeout->params, strlen(timeout->params),
-                      SQLITE_STATIC);
-    sqlite3_bind_int(st,  5, timeout->public_bus);
-    sqlite3_bind_int(st,  6, timeout->wakeup);
-    sqlite3_bind_int(st,  7, timeout->calendar);
-    sqlite3_bind_int(st,  8, timeout->expiry);
-    sqlite3_bind_text(st,  9, timeout->activity_id, strlen(timeout->activity_id),
-                      SQLITE_STATIC);
-    sqlite3_bind_int(st, 10, timeout->activity_duration_ms);
+    if (kept_existing)
+    {
+        *kept_existing = kept;
+    }
+
+    if (kept)
+    {
+        SLEEPDLOG_DEBUG("keeping existing timeout for (\"%s\", \"%s\", %s)",
+                        app_id, timeout->key, timeout->public_bus ? "public" : "private");
+        return true;
+    }
+
+    _print_timeout("timeout set", app_id, timeout->key, timeout->public_bus,
+                   _timeout_wall_expiry(timeout->calendar, timeout->expiry));
+
+    timeout_queue_put(app_id, timeout->key, timeout->public_bus,
+                      timeout->wakeup, timeout->calendar, timeout->expiry,
+                      timeout->window);
+
+    _timeouts_changed();
+
+    return true;
+}
+
+/**
+* @brief Add a timeout or replace the one with the same (app_id,key,public_bus).
+*
+* @param  timeout
+* @param  keep_existing if true an existing timeout is left untouched
+* @param  kept_existing if not NULL set to true when an existing timeout was
+*         left untouched
+*
+* @retval false if the database could not be updated
+*/
+static bool
+_timeout_upsert(_AlarmTimeout *timeout, bool keep_existing, bool *kept_existing)
+{
+    time_t now, head_before = 0, head_after = 0, wake_before = 0, wake_after = 0;
+    bool had_head, has_head, had_wake, has_wake;
+    bool kept = false;
+
+    g_return_val_if_fail(timeout != NULL, false);
+
+    now = reference_time();
+    had_head = timeout_queue_next(false, now, &head_before, NULL, NULL);
+    had_wake = timeout_queue_next_wake(now, &wake_before, NULL, NULL, NULL);
 
-    if (!_sql_step_finalize(__func__, st))
+    if (!_timeout_store(timeout, keep_existing, &kept))
     {
         return false;
     }
 
-    _update_timeouts();
+    if (kept_existing)
+    {
+        *kept_existing = kept;
+    }
+
+    if (kept)
+    {
+        return true;
+    }
+
+    has_head = timeout_queue_next(false, now, &head_after, NULL, NULL);
+    has_wake = timeout_queue_next_wake(now, &wake_after, NULL, NULL, NULL);
+
+    /* Only touch the schedule if this timeout is already due or it changed
+     * which timeout comes next or when to wake up. */
+    if (_timeout_wall_expiry(timeout->calendar, timeout->expiry) <= now ||
+            had_head != has_head || head_before != head_after ||
+            had_wake != has_wake || wake_before != wake_after)
+    {
+        _schedule_update_timeouts();
+    }
+
+    return true;
+}
+
+bool
+_timeout_set(_AlarmTimeout *timeout)
+{
+    return _timeout_upsert(timeout, false, NULL);
+}
+
+/**
+* @brief Whether setting this timeout would take its application past
+*        [alarms] max_timeouts_per_app.
+*
+* Replacing a pending timeout never does. Counts are kept by the timeout
+* queue, so this is two hash lookups.
+*/
+static bool
+_timeout_over_quota(const char *app_id, const char *key, bool public_bus)
+{
+    int quota = gSleepConfig.alarm_max_timeouts_per_app;
+
+    if (quota <= 0 || timeout_queue_contains(app_id, key, public_bus) ||
+            timeout_queue_app_count(app_id) < quota)
+    {
+        return false;
+    }
 
+    quota_rejected++;
+    SLEEPDLOG_WARNING(MSGID_TIMEOUT_QUOTA_EXCEEDED, 2, PMLOGKS("AppId", app_id ? : ""),
+                      PMLOGKFV("Quota", "%d", quota), "too many pending timeouts");
     return true;
 }
 
+/**
+* @brief Error reply for a timeout refused by _timeout_over_quota().
+*
+* @param  escaped_key  key of a setBatch entry, NULL for timeout/set
+*/
+static gchar *
+_timeout_quota_error(const char *escaped_key)
+{
+    gchar *key_member = escaped_key ?
+                        g_strdup_printf("\"key\":\"%s\",", escaped_key) : NULL;
+    gchar *error = g_strdup_printf("{\"returnValue\":false,%s\"errorText\":\"Too many "
+                                   "pending timeouts, the limit is %d per application.\"}",
+                                   key_member ? : "",
+                                   gSleepConfig.alarm_max_timeouts_per_app);
+
+    g_free(key_member);
+    return error;
+}
+
 static void
 _free_timeout_fields(_AlarmTimeoutNonConst *timeout)
 {
@@ -746,7 +1093,7 @@ _free_timeout_fields(_AlarmTimeoutNonConst *timeout)
 }
 
 /**
-* @brief Read an existing timeout from the database.
+* @brief Read an existing timeout from the store.
 *
 * @param  timeout
 * @param  app_id
@@ -762,12 +1109,6 @@ bool
 _timeout_read(_AlarmTimeoutNonConst *timeout, const char *app_id,
               const char *key, bool public_bus)
 {
-    bool ret = false;
-    int rc;
-    char **table;
-    int noRows, noCols;
-    char *zErrMsg;
-
     if (!app_id)
     {
         app_id = "";
@@ -781,56 +1122,7 @@ _timeout_read(_AlarmTimeoutNonConst *timeout, const char *app_id,
     SLEEPDLOG_DEBUG("SELECT (\"%s\", \"%s\", %s)", app_id, key,
                     public_bus ? "public" : "private");
 
-    char *sqlquery = g_strdup_printf(
-                         "SELECT t1key,app_id,key,uri,params,public_bus,wakeup,calendar,expiry,activity_id,activity_duration_ms FROM AlarmTimeout "
-                         "WHERE app_id=\"%s\" AND key=\"%s\" AND public_bus=%d", app_id, key,
-                         public_bus);
-
-    rc = sqlite3_get_table(timeout_db, sqlquery, &table, &noRows, &noCols,
-                           &zErrMsg);
-
-    g_free(sqlquery);
-
-    if (rc != SQLITE_OK)
-    {
-        SLEEPDLOG_WARNING(MSGID_SELECT_ALL_FROM_TIMEOUT, 2, PMLOGKS(ERRTEXT, zErrMsg),
-                          PMLOGKFV(ERRCODE, "%d", rc), "");
-        sqlite3_free(zErrMsg);
-    }
-    else
-    {
-        if (noRows)
-        {
-            if (noRows > 1)
-            {
-                SLEEPDLOG_DEBUG("%d rows for (%s, %s, %s)", noRows,
-                                app_id, key, public_bus ? "public" : "private");
-            }
-
-            timeout->table_id               = g_strdup(table[ noCols      ]);
-            timeout->app_id                 = g_strdup(table[ noCols +  1 ]);
-            timeout->key                    = g_strdup(table[ noCols +  2 ]);
-            timeout->uri                    = g_strdup(table[ noCols +  3 ]);
-            timeout->params                 = g_strdup(table[ noCols +  4 ]);
-            timeout->public_bus             = atoi(table[ noCols +  5 ]);
-            timeout->wakeup                 = atoi(table[ noCols +  6 ]);
-            timeout->calendar               = atoi(table[ noCols +  7 ]);
-            timeout->expiry                 = atol(table[ noCols +  8 ]);
-
-            // The two "activity" fields could be null if this is an
-            // old record where the new columns were inserted.
-            timeout->activity_id            = table[noCols + 9] ? g_strdup(
-                                                  table[noCols +  9]) : g_strdup(DEFAULT_ACTIVITY_ID);
-            timeout->activity_duration_ms   = table[noCols + 10] ? atoi(
-                                                  table[noCols + 10]) : TIMEOUT_KEEP_ALIVE_MS;
-
-            ret = true;
-        }
-
-        sqlite3_free_table(table);
-    }
-
-    return ret;
+    return store && store->get(timeout, app_id, key, public_bus);
 
 } // _timeout_read
 
@@ -846,10 +1138,6 @@ _timeout_read(_AlarmTimeoutNonConst *timeout, const char *app_id,
 bool
 _timeout_delete(const char *app_id, const char *key, bool public_bus)
 {
-    sqlite3_stmt *st = NULL;
-    const char *tail;
-    int rc;
-
     if (!app_id)
     {
         app_id = "";
@@ -864,21 +1152,18 @@ _timeout_delete(const char *app_id, const char *key, bool public_bus)
                     public_bus ? "public" : "private");
 
     /* Delete the matching timeout.*/
-    rc = sqlite3_prepare_v2(timeout_db,
-                            "DELETE FROM AlarmTimeout WHERE "
-                            "app_id=$1 AND key=$2 AND public_bus=$3", -1, &st, &tail);
-
-    if (rc != SQLITE_OK)
+    if (!store || !store->delete(app_id, key, public_bus))
     {
-        SLEEPDLOG_DEBUG("Could not remove AlarmTimeout, failed with %d", rc);
+        SLEEPDLOG_DEBUG("Could not remove AlarmTimeout");
         return false;
     }
 
-    sqlite3_bind_text(st, 1, app_id, app_id ? strlen(app_id) : -1, SQLITE_STATIC);
-    sqlite3_bind_text(st, 2, key, key ? strlen(key) : -1, SQLITE_STATIC);
-    sqlite3_bind_int(st, 3, public_bus);
+    if (timeout_queue_remove(app_id, key, public_bus))
+    {
+        _timeouts_changed();
+    }
 
-    return _sql_step_finalize(__func__, st);
+    return true;
 
 } // _timeout_delete
 
@@ -896,7 +1181,7 @@ _timeout_clear(const char *app_id, const char *key, bool public_bus)
 
     if (retVal)
     {
-        _update_timeouts();
+        _schedule_update_timeouts();
     }
 
     return retVal;
@@ -912,7 +1197,7 @@ _timeout_clear(const char *app_id, const char *key, bool public_bus)
 static gboolean
 _timer_check(gpointer data)
 {
-    _update_timeouts();
+    _schedule_update_timeouts();
     return TRUE;
 }
 
@@ -937,119 +1222,160 @@ _get_appid_dup(const char *app_instance_id)
     }
 }
 
-static bool
-_timeout_exists(const char *app_id, const char *key, bool public_bus)
+/**
+* @brief A timeout/set request, as parsed from its JSON object.
+*
+* Strings point into the JSON object.
+*/
+typedef struct
 {
-    _AlarmTimeoutNonConst timeout;
-
-    bool ret = _timeout_read(&timeout, app_id, key, public_bus);
+    const char *key;
+    const char *uri;
+    const char *params;
+    const char *activity_id;
+    int activity_duration_ms;
+    bool wakeup;
+    bool calendar;
+    time_t expiry;
+    time_t window;
+    time_t repeat;
 
-    if (ret)
-    {
-        _print_timeout("timeout exists", app_id, key, public_bus,
-                       timeout.expiry);
-        _free_timeout_fields(&timeout);
-    }
+    bool keep_existing_provided;
+    bool keep_existing;
+} _TimeoutSetRequest;
 
-    return ret;
-}
+typedef enum
+{
+    kTimeoutParseOk,
+    kTimeoutParseInvalid,
+    kTimeoutParseActivityTooShort,
+} TimeoutParseStatus;
 
 /**
-* @brief Handle a timeout/set message and add a new power timeout.
-* Relative timeouts can be set by passing the "in" parameter.
-* Absolute timeouts can be set by passing the "at" parameter.
+* @brief Parse the arguments of a timeout/set request.
 *
-* @param  sh
-* @param  message
-* @param  ctx
+* @param  object  JSON object of the request, or of one batch entry
+* @param  app_id  caller, for logging
+* @param  req     filled in on success
 *
-* @retval
+* @retval kTimeoutParseOk if req is valid
 */
-static bool
-_alarm_timeout_set(LSHandle *sh, LSMessage *message, void *ctx)
+static TimeoutParseStatus
+_timeout_parse_set(struct json_object *object, const char *app_id,
+                   _TimeoutSetRequest *req)
 {
-    bool retVal;
-    const char *app_instance_id = NULL;
-    const char *key = NULL;
     const char *at = NULL;
     const char *in = NULL;
-    const char *uri = NULL;
-    const char *params = NULL;
-    bool wakeup = false;
-    const char *activity_id = NULL;
-    int activity_duration_ms;
-    bool calendar;
-    time_t expiry;
-    _AlarmTimeout timeout;
+    const char *window = NULL;
+    const char *repeat = NULL;
     char **str_split;
-
-    char *app_id = NULL;
-
-    bool public_bus;
-    AlarmTimeoutType timeout_type;
-    struct json_object *object;
     struct json_object *duration_object;
     bool duration_provided;
-
-    // for optional "keep_existing" boolean argument
-    bool keep_existing_provided;
-    bool keep_existing = false;
     struct json_object *keep_existing_object;
 
-    object = json_tokener_parse(LSMessageGetPayload(message));
+    memset(req, 0, sizeof(*req));
 
-    if (!object)
+    if (!json_object_is_type(object, json_type_object))
     {
-        goto malformed_json;
+        return kTimeoutParseInvalid;
     }
 
-    app_instance_id = LSMessageGetApplicationID(message);
-
-        if(!get_json_string(object, "key", &key) || !get_json_string(object, "uri", &uri)
-        || !get_json_object_as_string(object, "params", &params))
+        if(!get_json_string(object, "key", &req->key) || !get_json_string(object, "uri", &req->uri)
+        || !get_json_object_as_string(object, "params", &req->params))
         {
-        goto invalid_json;
+        return kTimeoutParseInvalid;
         }
 
     if(json_object_object_get(object, "at") && !get_json_string(object, "at", &at))
     {
-        goto invalid_json;
+        return kTimeoutParseInvalid;
     }
     if(json_object_object_get(object, "in") && !get_json_string(object, "in", &in))
     {
-        goto invalid_json;
+        return kTimeoutParseInvalid;
     }
-    if(json_object_object_get(object, "wakeup") && !get_json_boolean(object, "wakeup", &wakeup))
+    if(json_object_object_get(object, "wakeup") && !get_json_boolean(object, "wakeup", &req->wakeup))
     {
-        goto invalid_json;
+        return kTimeoutParseInvalid;
     }
 
-    if (!app_instance_id)
+    // optional "HH:MM:SS" a wakeup timeout may fire late, to share a wakeup with others
+    if(json_object_object_get(object, "window") && !get_json_string(object, "window", &window))
     {
-        app_instance_id = "";
+        return kTimeoutParseInvalid;
+    }
+
+    if (window)
+    {
+        int HH, MM, SS;
+
+        if (!(ConvertJsonTime(window, &HH, &MM, &SS)) || (HH < 0 || HH > 24 || MM < 0 ||
+                MM > 59 || SS < 0 || SS > 59))
+        {
+            return kTimeoutParseInvalid;
+        }
+
+        req->window = SS + MM * 60 + HH * 60 * 60;
+    }
+
+    // optional "HH:MM:SS" period, or "daily"/"weekly" for an "at" timeout
+    if(json_object_object_get(object, "repeat") && !get_json_string(object, "repeat", &repeat))
+    {
+        return kTimeoutParseInvalid;
+    }
+
+    if (repeat)
+    {
+        int HH, MM, SS;
+
+        if (!strcmp(repeat, "daily") || !strcmp(repeat, "weekly"))
+        {
+            if (!at)
+            {
+                SLEEPDLOG_DEBUG("\"%s\" repeat w/o \"at\"", repeat);
+                return kTimeoutParseInvalid;
+            }
+
+            req->repeat = !strcmp(repeat, "daily") ? REPEAT_DAILY_SEC : REPEAT_WEEKLY_SEC;
+        }
+        else if (!(ConvertJsonTime(repeat, &HH, &MM, &SS)) || (HH < 0 || HH > 24 || MM < 0 ||
+                 MM > 59 || SS < 0 || SS > 59))
+        {
+            return kTimeoutParseInvalid;
+        }
+        else
+        {
+            req->repeat = SS + MM * 60 + HH * 60 * 60;
+        }
+
+        if (req->repeat < TIMEOUT_MINIMUM_SEC)
+        {
+            SLEEPDLOG_DEBUG("repeat below " TIMEOUT_MINIMUM_AS_TEXT);
+            return kTimeoutParseInvalid;
+        }
     }
 
     // optional arguments to allow caller to specify activity name and duration
-    if(json_object_object_get(object, "activity_id") && !get_json_string(object, "activity_id", &activity_id))
+    if(json_object_object_get(object, "activity_id") && !get_json_string(object, "activity_id", &req->activity_id))
     {
-        goto invalid_json;
+        return kTimeoutParseInvalid;
     }
     duration_provided = json_object_object_get_ex(object, "activity_duration_ms",
                         &duration_object);
 
-    if (activity_id)
+    if (req->activity_id)
     {
         if (!duration_provided)
         {
             SLEEPDLOG_DEBUG("activity_id w/o activity_duration_ms");
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
-        activity_duration_ms = json_object_get_int(duration_object);
+        req->activity_duration_ms = json_object_get_int(duration_object);
 
-        if (activity_duration_ms < ACTIVITY_DURATION_MS_MINIMUM)
+        if (req->activity_duration_ms < ACTIVITY_DURATION_MS_MINIMUM)
         {
-            goto activity_duration_too_short;
+            return kTimeoutParseActivityTooShort;
         }
     }
     else
@@ -1057,31 +1383,29 @@ _alarm_timeout_set(LSHandle *sh, LSMessage *message, void *ctx)
         if (duration_provided)
         {
             SLEEPDLOG_DEBUG("activity_duration_ms w/o activity_id");
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
-        activity_id = DEFAULT_ACTIVITY_ID;
-        activity_duration_ms = TIMEOUT_KEEP_ALIVE_MS;
+        req->activity_id = DEFAULT_ACTIVITY_ID;
+        req->activity_duration_ms = TIMEOUT_KEEP_ALIVE_MS;
     }
 
     // optional argument which tells us to keep a pre-existing alarm with the same key
-    keep_existing_provided = json_object_object_get_ex(object, "keep_existing",
-                             &keep_existing_object);
+    req->keep_existing_provided = json_object_object_get_ex(object, "keep_existing",
+                                  &keep_existing_object);
 
-    if (keep_existing_provided)
+    if (req->keep_existing_provided)
     {
-        keep_existing = json_object_get_boolean(keep_existing_object);
+        req->keep_existing = json_object_get_boolean(keep_existing_object);
     }
 
-    app_id = _get_appid_dup(app_instance_id);
-
     if (at)
     {
 
-        SLEEPDLOG_DEBUG("_alarm_timeout_set() : (%s,%s,%s) at %s", app_id, key,
-                        wakeup ? "wakeup" : "_", at);
+        SLEEPDLOG_DEBUG("_alarm_timeout_set() : (%s,%s,%s) at %s", app_id, req->key,
+                        req->wakeup ? "wakeup" : "_", at);
 
-        timeout_type = AlarmTimeoutCalendar;
+        req->calendar = true;
 
         int mm, dd, yyyy;
         int HH, MM, SS;
@@ -1091,13 +1415,13 @@ _alarm_timeout_set(LSHandle *sh, LSMessage *message, void *ctx)
 
         if (!str_split)
         {
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
         if ((NULL == str_split[0]) || (NULL == str_split[1]))
         {
             g_strfreev(str_split);
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
         date_str = g_strsplit(str_split[0], "/", 3);
@@ -1105,14 +1429,14 @@ _alarm_timeout_set(LSHandle *sh, LSMessage *message, void *ctx)
         if (!date_str)
         {
             g_strfreev(str_split);
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
         if ((NULL == date_str[0]) || (NULL == date_str[1]) || (NULL == date_str[2]))
         {
             g_strfreev(str_split);
             g_strfreev(date_str);
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
         mm = atoi(date_str[0]);
@@ -1124,14 +1448,14 @@ _alarm_timeout_set(LSHandle *sh, LSMessage *message, void *ctx)
                 MM < 0 || MM > 59 || SS < 0 || SS > 59))
         {
             g_strfreev(str_split);
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
         g_strfreev(str_split);
 
         if (!g_date_valid_dmy(dd, mm, yyyy))
         {
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
         struct tm gm_time;
@@ -1151,27 +1475,27 @@ _alarm_timeout_set(LSHandle *sh, LSMessage *message, void *ctx)
         gm_time.tm_year = yyyy - 1900;
 
         /* timegm converts time(GMT) -> seconds since epoch */
-        expiry = timegm(&gm_time);
+        req->expiry = timegm(&gm_time);
 
-        if (expiry < 0)
+        if (req->expiry < 0)
         {
-            expiry = 0;
+            req->expiry = 0;
         }
     }
     else if (in)
     {
 
-        SLEEPDLOG_DEBUG("%s (%s,%s) in %s", app_id, key, wakeup ? "wakeup" : "_",
+        SLEEPDLOG_DEBUG("%s (%s,%s) in %s", app_id, req->key, req->wakeup ? "wakeup" : "_",
                         in);
 
-        timeout_type = AlarmTimeoutRelative;
+        req->calendar = false;
 
         int HH, MM, SS;
 
         if (!(ConvertJsonTime(in, &HH, &MM, &SS)) || (HH < 0 || HH > 24 || MM < 0 ||
                 MM > 59 || SS < 0 || SS > 59))
         {
-            goto invalid_json;
+            return kTimeoutParseInvalid;
         }
 
         int delta = SS + MM * 60 + HH * 60 * 60;
@@ -1191,43 +1515,105 @@ _alarm_timeout_set(LSHandle *sh, LSMessage *message, void *ctx)
                             "%d seconds enforced on actual handsets", delta, TIMEOUT_MINIMUM_HANDSET_SEC);
         }
 
-        expiry = reference_time() + delta;
+        req->expiry = relative_time() + delta;
     }
     else
     {
-        goto invalid_json;
+        return kTimeoutParseInvalid;
     }
 
-    public_bus = LSMessageIsPublic(pwebos_sh, message);
-    calendar = (timeout_type == AlarmTimeoutCalendar);
-
-    bool kept_existing = false;
-    char *payload;
-
-    if (keep_existing && _timeout_exists(app_id, key, public_bus))
-    {
+    return kTimeoutParseOk;
+}
 
-        kept_existing = true;
+static void
+_timeout_create_from_request(_AlarmTimeout *timeout, const _TimeoutSetRequest *req,
+                             const char *app_id, bool public_bus)
+{
+    _timeout_create(timeout, app_id, req->key, req->uri, req->params,
+                    public_bus, req->wakeup, req->activity_id, req->activity_duration_ms,
+                    req->calendar, req->expiry);
+    timeout->window = req->window;
+    timeout->repeat = req->repeat;
+}
 
-        SLEEPDLOG_DEBUG("keeping existing timeout for (\"%s\", \"%s\", %s)",
-                        app_id, key, public_bus ? "public" : "private");
+/**
+* @brief Handle a timeout/set message and add a new power timeout.
+* Relative timeouts can be set by passing the "in" parameter.
+* Absolute timeouts can be set by passing the "at" parameter.
+* Wakeup timeouts may pass a "window" ("HH:MM:SS") by which they can be late,
+* letting sleepd serve several of them with one RTC wakeup.
+* A "repeat" period ("HH:MM:SS", or "daily"/"weekly" with "at") keeps the
+* timeout set after it fires, until it is cleared.
+*
+* @param  sh
+* @param  message
+* @param  ctx
+*
+* @retval
+*/
+static bool
+_alarm_timeout_set(LSHandle *sh, LSMessage *message, void *ctx)
+{
+    bool retVal;
+    const char *app_instance_id = NULL;
+    _AlarmTimeout timeout;
+    _TimeoutSetRequest req;
+
+    char *app_id = NULL;
+
+    bool public_bus;
+    struct json_object *object;
+
+    object = json_tokener_parse(LSMessageGetPayload(message));
+
+    if (!object)
+    {
+        goto malformed_json;
     }
-    else
+
+    app_instance_id = LSMessageGetApplicationID(message);
+
+    if (!app_instance_id)
     {
-        _timeout_create(&timeout, app_id, key, uri, params,
-                        public_bus, wakeup, activity_id, activity_duration_ms, calendar, expiry);
+        app_instance_id = "";
+    }
 
-        retVal = _timeout_set(&timeout);
+    app_id = _get_appid_dup(app_instance_id);
 
-        if (!retVal)
-        {
-            goto unknown_error;
-        }
+    switch (_timeout_parse_set(object, app_id, &req))
+    {
+        case kTimeoutParseOk:
+            break;
+
+        case kTimeoutParseActivityTooShort:
+            goto activity_duration_too_short;
+
+        default:
+            goto invalid_json;
+    }
+
+    public_bus = LSMessageIsPublic(pwebos_sh, message);
+
+    bool kept_existing = false;
+    char *payload;
+
+    _timeout_create_from_request(&timeout, &req, app_id, public_bus);
+
+    if (_timeout_over_quota(app_id, req.key, public_bus))
+    {
+        goto quota_exceeded;
+    }
+
+    retVal = _timeout_upsert(&timeout, req.keep_existing, &kept_existing);
+
+    if (!retVal)
+    {
+        goto unknown_error;
     }
 
-    char *escaped_key = g_strescape(key, NULL);
+    char *escaped_key = g_strescape(req.key, NULL);
 
-    if (keep_existing_provided)
+    if (req.keep_existing_provided)
     {
         payload = g_strdup_printf(
                       "{\"returnValue\":true,\"key\":\"%s\",\"kept_existing\":%s}", escaped_key,
@@ -1263,6 +1649,18 @@ activity_duration_too_short:
 
     goto cleanup;
 
+quota_exceeded:
+    payload = _timeout_quota_error(NULL);
+    retVal = LSMessageReply(sh, message, payload, NULL);
+    g_free(payload);
+
+    if (!retVal)
+    {
+        SLEEPDLOG_WARNING(MSGID_LSMESSAGE_REPLY_FAIL, 0, "could not send reply");
+    }
+
+    goto cleanup;
+
 unknown_error:
     retVal = LSMessageReply(sh, message, "{\"returnValue\":false,"
                             "\"errorText\":\"Could not set timeout.\"}", NULL);
@@ -1299,6 +1697,173 @@ cleanup:
     return true;
 }
 
+/**
+* @brief Commit a batch, or resynchronize the timeout queue with the
+*        store if that failed.
+*/
+static bool
+_timeout_batch_commit(void)
+{
+    if (store->commit())
+    {
+        return true;
+    }
+
+    timeout_queue_clear();
+    _timeout_queue_load();
+    return false;
+}
+
+/**
+* @brief Handle a timeout/setBatch message and add several timeouts at once.
+*
+* Takes {"timeouts":[...]} where each entry has the arguments of timeout/set.
+* All entries are written in one transaction and the next wakeup is queued
+* once. The reply carries one result per entry, in order.
+*
+* @param  sh
+* @param  message
+* @param  ctx
+*
+* @retval
+*/
+static bool
+_alarm_timeout_set_batch(LSHandle *sh, LSMessage *message, void *ctx)
+{
+    const char *app_instance_id;
+    struct json_object *object;
+    struct json_object *entries;
+    GString *payload = NULL;
+    char *app_id = NULL;
+    bool public_bus;
+    int count;
+
+    object = json_tokener_parse(LSMessageGetPayload(message));
+
+    if (!object)
+    {
+        goto malformed_json;
+    }
+
+    if (!json_object_object_get_ex(object, "timeouts", &entries) ||
+            !json_object_is_type(entries, json_type_array))
+    {
+        goto invalid_json;
+    }
+
+    app_instance_id = LSMessageGetApplicationID(message);
+    app_id = _get_appid_dup(app_instance_id ? : "");
+    public_bus = LSMessageIsPublic(pwebos_sh, message);
+
+    count = json_object_array_length(entries);
+    payload = g_string_new("{\"returnValue\":true,\"results\":[");
+
+    if (!store || !store->begin())
+    {
+        goto unknown_error;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        _TimeoutSetRequest req;
+        _AlarmTimeout timeout;
+        bool kept_existing = false;
+        TimeoutParseStatus status;
+
+        status = _timeout_parse_set(json_object_array_get_idx(entries, i), app_id, &req);
+
+        if (i)
+        {
+            g_string_append_c(payload, ',');
+        }
+
+        if (status != kTimeoutParseOk)
+        {
+            g_string_append(payload, status == kTimeoutParseActivityTooShort ?
+                            "{\"returnValue\":false,\"errorText\":\"activity_duration_ms less than "
+                            ACTIVITY_DURATION_MS_MINIMUM_AS_TEXT ".\"}" :
+                            "{\"returnValue\":false,\"errorText\":\"Invalid format for 'timeout/set'.\"}");
+            continue;
+        }
+
+        char *escaped_key = g_strescape(req.key, NULL);
+
+        _timeout_create_from_request(&timeout, &req, app_id, public_bus);
+
+        /* entries stored so far count against the quota already */
+        if (_timeout_over_quota(app_id, req.key, public_bus))
+        {
+            gchar *error = _timeout_quota_error(escaped_key);
+            g_string_append(payload, error);
+            g_free(error);
+        }
+        else if (!_timeout_store(&timeout, req.keep_existing, &kept_existing))
+        {
+            g_string_append_printf(payload,
+                                   "{\"returnValue\":false,\"key\":\"%s\","
+                                   "\"errorText\":\"Could not set timeout.\"}", escaped_key);
+        }
+        else if (req.keep_existing_provided)
+        {
+            g_string_append_printf(payload,
+                                   "{\"returnValue\":true,\"key\":\"%s\",\"kept_existing\":%s}",
+                                   escaped_key, kept_existing ? "true" : "false");
+        }
+        else
+        {
+            g_string_append_printf(payload, "{\"returnValue\":true,\"key\":\"%s\"}",
+                                   escaped_key);
+        }
+
+        g_free(escaped_key);
+    }
+
+    if (!_timeout_batch_commit())
+    {
+        goto unknown_error;
+    }
+
+    g_string_append(payload, "]}");
+
+    _schedule_update_timeouts();
+
+    if (!LSMessageReply(sh, message, payload->str, NULL))
+    {
+        SLEEPDLOG_WARNING(MSGID_LSMESSAGE_REPLY_FAIL, 0, "could not send reply");
+    }
+
+    goto cleanup;
+
+unknown_error:
+    if (!LSMessageReply(sh, message, "{\"returnValue\":false,"
+                        "\"errorText\":\"Could not set timeouts.\"}", NULL))
+    {
+        SLEEPDLOG_WARNING(MSGID_UNKNOWN_ERR, 0, "could not send reply <unknown error>");
+    }
+
+    goto cleanup;
+invalid_json:
+    LSMessageReplyErrorInvalidParams(sh, message);
+    goto cleanup;
+malformed_json:
+    LSMessageReplyErrorBadJSON(sh, message);
+    goto cleanup;
+cleanup:
+
+    if (object)
+    {
+        json_object_put(object);
+    }
+
+    if (payload)
+    {
+        g_string_free(payload, TRUE);
+    }
+
+    g_free(app_id);
+    return true;
+}
+
 /**
 * @brief Handle a timeout/clear message and delete a timeout by its key.
 *
@@ -1398,10 +1963,490 @@ cleanup:
 
 }
 
+/**
+* @brief Handle a timeout/clearBatch message and delete several timeouts by
+*        their keys.
+*
+* Takes {"keys":[...]}. All keys are removed in one transaction and the next
+* wakeup is queued once. The reply carries one result per key, in order.
+*
+* @param  sh
+* @param  message
+* @param  ctx
+*
+* @retval
+*/
+static bool
+_alarm_timeout_clear_batch(LSHandle *sh, LSMessage *message, void *ctx)
+{
+    const char *app_instance_id;
+    struct json_object *object;
+    struct json_object *keys;
+    GString *payload = NULL;
+    char *app_id = NULL;
+    bool public_bus;
+    int count;
+
+    object = json_tokener_parse(LSMessageGetPayload(message));
+
+    if (!object)
+    {
+        goto malformed_json;
+    }
+
+    if (!json_object_object_get_ex(object, "keys", &keys) ||
+            !json_object_is_type(keys, json_type_array))
+    {
+        goto invalid_json;
+    }
+
+    app_instance_id = LSMessageGetApplicationID(message);
+    app_id = _get_appid_dup(app_instance_id ? : "");
+    public_bus = LSMessageIsPublic(pwebos_sh, message);
+
+    count = json_object_array_length(keys);
+    payload = g_string_new("{\"returnValue\":true,\"results\":[");
+
+    if (!store || !store->begin())
+    {
+        goto unknown_error;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct json_object *entry = json_object_array_get_idx(keys, i);
+
+        if (i)
+        {
+            g_string_append_c(payload, ',');
+        }
+
+        if (!json_object_is_type(entry, json_type_string))
+        {
+            g_string_append(payload, "{\"returnValue\":false,\"errorText\":\"Invalid key.\"}");
+            continue;
+        }
+
+        const char *key = json_object_get_string(entry);
+        char *escaped_key = g_strescape(key, NULL);
+
+        SLEEPDLOG_DEBUG("_alarm_timeout_clear_batch() : (%s,%s,%s)", app_id, key,
+                        public_bus ? "public" : "private");
+
+        if (_timeout_delete(app_id, key, public_bus))
+        {
+            g_string_append_printf(payload, "{\"returnValue\":true,\"key\":\"%s\"}",
+                                   escaped_key);
+        }
+        else
+        {
+            g_string_append_printf(payload,
+                                   "{\"returnValue\":false,\"key\":\"%s\","
+                                   "\"errorText\":\"Could not find key.\"}", escaped_key);
+        }
+
+        g_free(escaped_key);
+    }
+
+    if (!_timeout_batch_commit())
+    {
+        goto unknown_error;
+    }
+
+    g_string_append(payload, "]}");
+
+    _schedule_update_timeouts();
+
+    if (!LSMessageReply(sh, message, payload->str, NULL))
+    {
+        SLEEPDLOG_WARNING(MSGID_LSMESSAGE_REPLY_FAIL, 0, "could not send reply");
+    }
+
+    goto cleanup;
+
+unknown_error:
+    if (!LSMessageReply(sh, message, "{\"returnValue\":false,"
+                        "\"errorText\":\"Could not clear timeouts.\"}", NULL))
+    {
+        SLEEPDLOG_WARNING(MSGID_UNKNOWN_ERR, 0, "could not send reply <unknown error>");
+    }
+
+    goto cleanup;
+invalid_json:
+    LSMessageReplyErrorInvalidParams(sh, message);
+    goto cleanup;
+malformed_json:
+    LSMessageReplyErrorBadJSON(sh, message);
+    goto cleanup;
+cleanup:
+
+    if (object)
+    {
+        json_object_put(object);
+    }
+
+    if (payload)
+    {
+        g_string_free(payload, TRUE);
+    }
+
+    g_free(app_id);
+    return true;
+}
+
+#define TIMEOUT_LIST_DEFAULT_LIMIT 50
+#define TIMEOUT_LIST_MAX_LIMIT     500
+
+/**
+* @brief One page of a timeout/list reply being built.
+*/
+typedef struct
+{
+    GString *payload;
+    int      count;
+    time_t   last_expiry;
+    gint64   last_id;
+} _TimeoutListPage;
+
+static void
+_timeout_list_append(const _AlarmTimeout *timeout, time_t wall_expiry, gint64 id,
+                     void *data)
+{
+    _TimeoutListPage *page = data;
+    char *app_id = g_strescape(timeout->app_id, NULL);
+    char *key = g_strescape(timeout->key, NULL);
+    char *uri = g_strescape(timeout->uri, NULL);
+
+    if (page->count++)
+    {
+        g_string_append_c(page->payload, ',');
+    }
+
+    g_string_append_printf(page->payload,
+                           "{\"app_id\":\"%s\",\"key\":\"%s\",\"uri\":\"%s\","
+                           "\"public_bus\":%s,\"wakeup\":%s,\"calendar\":%s,\"expiry\":%lld}",
+                           app_id, key, uri,
+                           timeout->public_bus ? "true" : "false",
+                           timeout->wakeup ? "true" : "false",
+                           timeout->calendar ? "true" : "false",
+                           (long long) wall_expiry);
+
+    page->last_expiry = wall_expiry;
+    page->last_id = id;
+
+    g_free(app_id);
+    g_free(key);
+    g_free(uri);
+}
+
+/**
+* @brief Handle a timeout/list message and return one page of pending
+*        timeouts ordered by expiry.
+*
+* Optional arguments:
+*   "app_id"     only timeouts of this application
+*   "wakeup"     only wakeup (true) or non-wakeup (false) timeouts
+*   "from","to"  expiry range, seconds since epoch (inclusive)
+*   "limit"      page size
+*   "cursor"     value of "cursor" in the previous page's reply
+*   "subscribe"  get {"changed":true} whenever pending timeouts change
+*
+* Calendar and relative timeouts are kept apart by expiry in both stores and
+* merged, so only a page worth of timeouts is ever looked at.
+*
+* @param  sh
+* @param  message
+* @param  ctx
+*
+* @retval
+*/
+static bool
+_alarm_timeout_list(LSHandle *sh, LSMessage *message, void *ctx)
+{
+    struct json_object *object;
+    struct json_object *value;
+    const char *cursor = NULL;
+    /* far enough from the limits to survive the shift into relative time */
+    TimeoutStoreListQuery query =
+    {
+        .after = G_MININT64 / 2,
+        .after_id = G_MAXINT64,
+        .until = G_MAXINT64 / 2,
+        .app_id = NULL,
+        .wakeup = -1,
+        .limit = TIMEOUT_LIST_DEFAULT_LIMIT,
+    };
+    bool subscribe = false;
+    bool subscribed = false;
+    bool more = false;
+    _TimeoutListPage page = { 0 };
+    LSError lserror;
+    LSErrorInit(&lserror);
+
+    object = json_tokener_parse(LSMessageGetPayload(message));
+
+    if (!object)
+    {
+        goto malformed_json;
+    }
+
+    if (json_object_object_get(object, "app_id") &&
+            !get_json_string(object, "app_id", &query.app_id))
+    {
+        goto invalid_json;
+    }
+
+    if (json_object_object_get(object, "wakeup"))
+    {
+        bool wakeup;
+
+        if (!get_json_boolean(object, "wakeup", &wakeup))
+        {
+            goto invalid_json;
+        }
+
+        query.wakeup = wakeup;
+    }
+
+    if (json_object_object_get_ex(object, "from", &value))
+    {
+        if (!json_object_is_type(value, json_type_int))
+        {
+            goto invalid_json;
+        }
+
+        /* as if the page before ended just ahead of 'from' */
+        query.after = CLAMP(json_object_get_int64(value), G_MININT64 / 2,
+                            G_MAXINT64 / 2) - 1;
+    }
+
+    if (json_object_object_get_ex(object, "to", &value))
+    {
+        if (!json_object_is_type(value, json_type_int))
+        {
+            goto invalid_json;
+        }
+
+        query.until = CLAMP(json_object_get_int64(value), G_MININT64 / 2,
+                            G_MAXINT64 / 2);
+    }
+
+    if (json_object_object_get_ex(object, "limit", &value))
+    {
+        if (!json_object_is_type(value, json_type_int))
+        {
+            goto invalid_json;
+        }
+
+        query.limit = json_object_get_int(value);
+
+        if (query.limit <= 0 || query.limit > TIMEOUT_LIST_MAX_LIMIT)
+        {
+            goto invalid_json;
+        }
+    }
+
+    if (json_object_object_get(object, "cursor"))
+    {
+        long long cursor_expiry, cursor_id;
+
+        if (!get_json_string(object, "cursor", &cursor) ||
+                sscanf(cursor, "%lld:%lld", &cursor_expiry, &cursor_id) != 2)
+        {
+            goto invalid_json;
+        }
+
+        query.after = cursor_expiry;
+        query.after_id = cursor_id;
+    }
+
+    if (json_object_object_get_ex(object, "subscribe", &value))
+    {
+        subscribe = json_object_get_boolean(value);
+    }
+
+    if (subscribe)
+    {
+        subscribed = LSSubscriptionAdd(sh, TIMEOUT_LIST_SUBSCRIPTION, message, &lserror);
+
+        if (!subscribed)
+        {
+            LSErrorPrint(&lserror, stderr);
+            LSErrorFree(&lserror);
+        }
+    }
+
+    page.payload = g_string_new("{\"returnValue\":true,\"timeouts\":[");
+
+    if (!store || !store->list(&query, _timeout_list_append, &page, &more))
+    {
+        goto unknown_error;
+    }
+
+    g_string_append(page.payload, "]");
+
+    if (more)
+    {
+        /* hand out where this page stopped */
+        g_string_append_printf(page.payload, ",\"cursor\":\"%lld:%lld\"",
+                               (long long) page.last_expiry, (long long) page.last_id);
+    }
+
+    g_string_append_printf(page.payload, ",\"subscribed\":%s}",
+                           subscribed ? "true" : "false");
+
+    if (!LSMessageReply(sh, message, page.payload->str, NULL))
+    {
+        SLEEPDLOG_WARNING(MSGID_LSMESSAGE_REPLY_FAIL, 0, "could not send reply");
+    }
+
+    goto cleanup;
+
+unknown_error:
+    LSMessageReplyCustomError(sh, message, "Could not list timeouts.");
+    goto cleanup;
+invalid_json:
+    LSMessageReplyErrorInvalidParams(sh, message);
+    goto cleanup;
+malformed_json:
+    LSMessageReplyErrorBadJSON(sh, message);
+    goto cleanup;
+cleanup:
+
+    if (page.payload)
+    {
+        g_string_free(page.payload, TRUE);
+    }
+
+    if (object)
+    {
+        json_object_put(object);
+    }
+
+    return true;
+}
+
+void
+timeout_alarm_shutdown(void)
+{
+    if (store)
+    {
+        store->flush();
+    }
+
+    /** the deprecated interface's alarm log */
+    void alarm_flush(void);
+    alarm_flush();
+}
+
+static void
+_diagnostics_app_usage(const char *app_id, guint count, void *data)
+{
+    GString *payload = data;
+    char *escaped = g_strescape(app_id, NULL);
+
+    if (payload->str[payload->len - 1] != '{')
+    {
+        g_string_append_c(payload, ',');
+    }
+
+    g_string_append_printf(payload, "\"%s\":%u", escaped, count);
+    g_free(escaped);
+}
+
+/**
+* @brief Handle a diagnostics message and report internal counters.
+*
+* @param  sh
+* @param  message
+* @param  ctx
+*
+* @retval
+*/
+static bool
+_alarm_timeout_diagnostics(LSHandle *sh, LSMessage *message, void *ctx)
+{
+    GString *payload = g_string_sized_new(256);
+
+    g_string_append_printf(payload,
+                           "{\"returnValue\":true,"
+                           "\"pending\":%u,"
+                           "\"expiry\":{\"passes\":%lu,\"expiredTotal\":%lu,"
+                           "\"expiredLast\":%u,\"expiredMax\":%u}",
+                           timeout_queue_size(),
+                           expiry_stats.passes, expiry_stats.expired_total,
+                           expiry_stats.expired_last, expiry_stats.expired_max);
+
+    if (store)
+    {
+        g_string_append_printf(payload, ",\"storage\":\"%s\"", store->name);
+        store->diagnostics(payload);
+    }
+
+    time_t now = reference_time();
+    time_t queue_next = 0, db_next = 0;
+    bool queue_found = timeout_queue_next(true, now, &queue_next, NULL, NULL);
+    bool db_found = store && store->next_wakeup(now, &db_next);
+
+    g_string_append_printf(payload,
+                           ",\"nextWakeup\":{\"queue\":%lld,\"database\":%lld,\"consistent\":%s}",
+                           queue_found ? (long long) queue_next : -1LL,
+                           db_found ? (long long) db_next : -1LL,
+                           (queue_found == db_found && queue_next == db_next) ? "true" : "false");
+
+    g_string_append_printf(payload,
+                           ",\"wake\":{\"backend\":\"%s\",\"armed\":%lld,\"covers\":%u,\"shared\":%lu,"
+                           "\"wakeupsSaved\":%lu}",
+                           alarm_backend_name(),
+                           wake_stats.wake ? (long long) wake_stats.wake : -1LL,
+                           wake_stats.wake ? wake_stats.covers : 0,
+                           wake_stats.shared, wake_stats.saved);
+
+    g_string_append_printf(payload,
+                           ",\"fireQueue\":{\"limit\":%d,\"pending\":%u,\"inFlight\":%u,"
+                           "\"maxPending\":%u,\"sent\":%lu,\"replies\":%lu,"
+                           "\"latencyAvgMs\":%lld,\"latencyMaxMs\":%lld}",
+                           gSleepConfig.alarm_fire_concurrency,
+                           fire_queue.pending, fire_queue.in_flight, fire_queue.max_pending,
+                           fire_queue.sent, fire_queue.replies,
+                           fire_queue.replies ?
+                           (long long) (fire_queue.latency_total_us / fire_queue.replies / 1000) : 0LL,
+                           (long long) (fire_queue.latency_max_us / 1000));
+
+    /* pending timeouts per application, "" for callers without an app id */
+    g_string_append_printf(payload, ",\"quota\":{\"limit\":%d,\"rejected\":%lu,\"apps\":{",
+                           gSleepConfig.alarm_max_timeouts_per_app, quota_rejected);
+    timeout_queue_foreach_app(_diagnostics_app_usage, payload);
+    g_string_append(payload, "}}");
+
+    g_string_append_printf(payload,
+                           ",\"reschedule\":{\"requested\":%lu,\"coalesced\":%lu,\"ran\":%lu}",
+                           update_stats.requested, update_stats.coalesced, update_stats.ran);
+
+    g_string_append(payload, "}");
+
+    if (!LSMessageReply(sh, message, payload->str, NULL))
+    {
+        SLEEPDLOG_WARNING(MSGID_LSMESSAGE_REPLY_FAIL, 0, "could not send reply");
+    }
+
+    g_string_free(payload, TRUE);
+    return true;
+}
+
 static LSMethod timeout_methods[] =
 {
     { "set", _alarm_timeout_set },
     { "clear", _alarm_timeout_clear },
+    { "setBatch", _alarm_timeout_set_batch },
+    { "clearBatch", _alarm_timeout_clear_batch },
+    { },
+};
+
+static LSMethod timeout_private_methods[] =
+{
+    { "diagnostics", _alarm_timeout_diagnostics },
+    { "list", _alarm_timeout_list },
     { },
 };
 
@@ -1418,7 +2463,7 @@ static LSMethod timeout_methods[] =
 static bool
 _resume_callback(LSHandle *sh, LSMessage *message, void *ctx)
 {
-    _update_timeouts();
+    _schedule_update_timeouts();
     return true;
 }
 
@@ -1427,43 +2472,30 @@ _alarms_timeout_init(void)
 {
     bool retVal;
 
-    gchar *timeout_db_name = g_build_filename(gSleepConfig.preference_dir,
-                             TIMEOUT_DATABASE_NAME, NULL);
-
     if (gSleepConfig.disable_rtc_alarms)
     {
         SLEEPDLOG_DEBUG("RTC alarms disabled");
         return 0;
     }
 
-    gchar *timeout_db_path = g_path_get_dirname(timeout_db_name);
-    g_mkdir_with_parents(timeout_db_path, S_IRWXU);
-    g_free(timeout_db_path);
-
-    retVal = smart_sql_open(timeout_db_name, &timeout_db);
-
-    if (!retVal)
-    {
-        SLEEPDLOG_ERROR(MSGID_DB_OPEN_ERR, 1, PMLOGKS("DBName", timeout_db_name),
-                        "Failed to open database");
-        goto error;
-    }
-
-    g_free(timeout_db_name);
+    gchar *drift_file = g_build_filename(gSleepConfig.preference_dir,
+                                         TIMEOUT_DRIFT_FILE_NAME, NULL);
+    reference_time_init(drift_file);
+    g_free(drift_file);
 
-    retVal = smart_sql_exec(timeout_db, kSysTimeoutDatabaseCreateSchema);
+    store = timeout_store_open(gSleepConfig.alarm_storage,
+                               gSleepConfig.preference_dir);
 
-    if (!retVal)
+    if (!store)
     {
-        SLEEPDLOG_ERROR(MSGID_DB_CREATE_ERR, 0, "could not create database");
         goto error;
     }
 
-    retVal = smart_sql_exec(timeout_db, kSysTimeoutDatabaseCreateIndex);
+    retVal = _timeout_queue_load();
 
     if (!retVal)
     {
-        SLEEPDLOG_ERROR(MSGID_INDEX_CREATE_FAIL, 0, "could not create index");
+        SLEEPDLOG_ERROR(MSGID_DB_CREATE_ERR, 0, "could not load timeout queue");
         goto error;
     }
 
@@ -1515,7 +2547,7 @@ _alarms_timeout_init(void)
         {
 
             if (!LSPalmServiceRegisterCategory(pwebos_sh,
-                                               "/", timeout_methods /*public*/, NULL /*private*/, NULL, NULL,
+                                               "/", timeout_methods /*public*/, timeout_private_methods /*private*/, NULL, NULL,
                                                &lserror))
             {
                 SLEEPDLOG_ERROR(MSGID_CATEGORY_REG_FAIL, 1, PMLOGKS(ERRTEXT, lserror.message),
@@ -1539,6 +2571,8 @@ _alarms_timeout_init(void)
         SLEEPDLOG_DEBUG("could not initialize reference clock");
     }
 
+    clock_watched = reference_time_watch(GetMainLoopContext(), _clock_changed);
+
 #ifndef WITHOUT_RTC_WATCHDOG
     GTimerSource *timer_rtc_check = g_timer_source_new_seconds(5 * 60);
     g_source_set_callback((GSource *)timer_rtc_check,
@@ -1546,6 +2580,8 @@ _alarms_timeout_init(void)
     g_source_attach((GSource *)timer_rtc_check, GetMainLoopContext());
 #endif
 
+    alarm_backend_init(gSleepConfig.alarm_backend, _rtc_alarm_fired);
+
     sTimerCheck = g_timer_source_new_seconds(60 * 60);
     g_source_set_callback((GSource *)sTimerCheck,
                           (GSourceFunc)_timer_check, NULL, NULL);
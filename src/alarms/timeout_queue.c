@@ -0,0 +1,800 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+* @file timeout_queue.c
+*
+* @brief In-memory index of pending timeouts.
+*
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "timeout_queue.h"
+
+/**
+ * @addtogroup NewInterface
+ * @{
+ */
+
+/* Timing wheel geometry: WHEEL_LEVELS levels of WHEEL_SIZE slots, a slot
+ * of level L being WHEEL_SIZE^L seconds wide. Four levels of 64 slots reach
+ * 2^24 seconds (about 194 days) ahead; anything further waits in the
+ * overflow list. */
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+/**
+* @brief A single queued timeout.
+*/
+typedef struct
+{
+    char          *app_id;
+    char          *key;
+    bool           public_bus;
+    bool           wakeup;
+    bool           calendar;
+    time_t         expiry;  /*< wall time if calendar, else relative time */
+    time_t         window;  /*< may fire up to this many seconds late */
+
+    GSequenceIter *iter;    /*< position in its ordering, wakeup timeouts */
+
+    GList          link;    /*< node in its wheel list, other timeouts */
+    GQueue        *list;
+    int            level;   /*< wheel level, -1 if due or overflow */
+    int            index;   /*< slot within the level */
+} _TimeoutEntry;
+
+/**
+* @brief Hierarchical timing wheel.
+*
+* A timeout sits at the lowest level whose current revolution holds its
+* expiry, in the slot covering it. Insert and remove are O(1). Moving the
+* wheel forward empties the slots it passed, putting each timeout one or
+* more levels down, so a timeout moves at most WHEEL_LEVELS times. Finding
+* the next timeout looks at WHEEL_LEVELS occupancy masks.
+*/
+typedef struct
+{
+    time_t  now;                            /*< timeouts expiring by now are in 'due' */
+    GQueue  due;
+    GQueue  slot[WHEEL_LEVELS][WHEEL_SIZE];
+    guint64 occupied[WHEEL_LEVELS];         /*< bit i set if slot[level][i] is not empty */
+    GQueue  overflow;
+} _TimerWheel;
+
+/**
+* @brief Timeout queue.
+*/
+typedef struct
+{
+    GHashTable *entries;    /*< (app_id,key,public_bus) -> _TimeoutEntry */
+    GHashTable *per_app;    /*< app_id -> number of entries */
+
+    /* Wakeup timeouts sorted by expiry, indexed by [calendar]. Calendar and
+     * relative timeouts are kept apart so that each sequence holds a single
+     * time domain and never needs re-sorting when the clocks drift apart.
+     * The RTC needs their exact order, windows included. */
+    GSequence  *seq[2];
+
+    /* Non-wakeup timeouts, one wheel per time domain, indexed by [calendar] */
+    _TimerWheel wheel[2];
+
+    time_t      drift;      /*< relative time + drift = wall time */
+} _TimeoutQueue;
+
+static _TimeoutQueue queue;
+
+/* IdleCheck peeks the next wakeup from the suspend thread */
+static GMutex queue_lock;
+
+static guint
+_entry_hash(gconstpointer data)
+{
+    const _TimeoutEntry *e = data;
+
+    return (g_str_hash(e->app_id) * 31 + g_str_hash(e->key)) ^ e->public_bus;
+}
+
+static gboolean
+_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const _TimeoutEntry *e1 = a;
+    const _TimeoutEntry *e2 = b;
+
+    return e1->public_bus == e2->public_bus &&
+           strcmp(e1->app_id, e2->app_id) == 0 &&
+           strcmp(e1->key, e2->key) == 0;
+}
+
+static void
+_entry_free(_TimeoutEntry *e)
+{
+    g_free(e->app_id);
+    g_free(e->key);
+    g_free(e);
+}
+
+static gint
+_entry_cmp_func(_TimeoutEntry *a, _TimeoutEntry *b, gpointer data)
+{
+    return (a->expiry < b->expiry) ? -1 :
+           (a->expiry == b->expiry) ? 0 : 1;
+}
+
+static time_t
+_entry_wall_expiry(const _TimeoutEntry *e)
+{
+    return e->calendar ? e->expiry : e->expiry + queue.drift;
+}
+
+/**
+* @brief Mask of the bits above bit 'i'.
+*/
+static guint64
+_bits_above(int i)
+{
+    return i >= WHEEL_SIZE - 1 ? 0 : ~G_GUINT64_CONSTANT(0) << (i + 1);
+}
+
+static int
+_lowest_bit(guint64 bits)
+{
+    int i = 0;
+
+    while (!(bits & 1))
+    {
+        bits >>= 1;
+        i++;
+    }
+
+    return i;
+}
+
+static void
+_wheel_link(_TimerWheel *w, _TimeoutEntry *e)
+{
+    GQueue *list = &w->overflow;
+
+    e->level = -1;
+
+    if (e->expiry <= w->now)
+    {
+        list = &w->due;
+    }
+    else
+    {
+        for (int level = 0; level < WHEEL_LEVELS; level++)
+        {
+            int shift = WHEEL_BITS * (level + 1);
+
+            if ((e->expiry >> shift) == (w->now >> shift))
+            {
+                e->level = level;
+                e->index = (e->expiry >> (WHEEL_BITS * level)) & WHEEL_MASK;
+                list = &w->slot[level][e->index];
+                w->occupied[level] |= G_GUINT64_CONSTANT(1) << e->index;
+                break;
+            }
+        }
+    }
+
+    e->link.data = e;
+    e->list = list;
+    g_queue_push_tail_link(list, &e->link);
+}
+
+static void
+_wheel_unlink(_TimerWheel *w, _TimeoutEntry *e)
+{
+    g_queue_unlink(e->list, &e->link);
+
+    if (e->level >= 0 && g_queue_is_empty(e->list))
+    {
+        w->occupied[e->level] &= ~(G_GUINT64_CONSTANT(1) << e->index);
+    }
+
+    e->list = NULL;
+}
+
+/**
+* @brief Move all timeouts of 'list' to 'moved'.
+*/
+static void
+_wheel_take(GQueue *list, GQueue *moved)
+{
+    GList *link;
+
+    while ((link = g_queue_pop_head_link(list)))
+    {
+        g_queue_push_tail_link(moved, link);
+    }
+}
+
+/**
+* @brief Turn the wheel to 'to', re-placing the timeouts of the slots it
+*        passed.
+*/
+static void
+_wheel_advance(_TimerWheel *w, time_t to)
+{
+    GQueue moved = G_QUEUE_INIT;
+    GList *link;
+
+    if (to == w->now)
+    {
+        return;
+    }
+
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        int shift = WHEEL_BITS * level;
+        int from = (w->now >> shift) & WHEEL_MASK;
+        guint64 passed;
+
+        if (to < w->now)
+        {
+            /* the clock went back, everything may be misplaced */
+            passed = ~G_GUINT64_CONSTANT(0);
+        }
+        else if ((to >> (shift + WHEEL_BITS)) == (w->now >> (shift + WHEEL_BITS)))
+        {
+            /* still the same revolution: slots up to and including the one
+             * of 'to' are either due or belong to a lower level now */
+            passed = _bits_above(from) & ~_bits_above((to >> shift) & WHEEL_MASK);
+        }
+        else
+        {
+            passed = _bits_above(from);
+        }
+
+        passed &= w->occupied[level];
+        w->occupied[level] &= ~passed;
+
+        while (passed)
+        {
+            int index = _lowest_bit(passed);
+
+            _wheel_take(&w->slot[level][index], &moved);
+            passed &= ~(G_GUINT64_CONSTANT(1) << index);
+        }
+    }
+
+    if (to < w->now)
+    {
+        _wheel_take(&w->due, &moved);
+    }
+
+    if (to < w->now ||
+            (to >> (WHEEL_BITS * WHEEL_LEVELS)) != (w->now >> (WHEEL_BITS * WHEEL_LEVELS)))
+    {
+        _wheel_take(&w->overflow, &moved);
+    }
+
+    w->now = to;
+
+    while ((link = g_queue_pop_head_link(&moved)))
+    {
+        _wheel_link(w, link->data);
+    }
+}
+
+/**
+* @brief Earliest entry of a list.
+*/
+static _TimeoutEntry *
+_list_min(GQueue *list)
+{
+    _TimeoutEntry *min = NULL;
+
+    for (GList *l = list->head; l; l = l->next)
+    {
+        _TimeoutEntry *e = l->data;
+
+        if (!min || e->expiry < min->expiry)
+        {
+            min = e;
+        }
+    }
+
+    return min;
+}
+
+/**
+* @brief First entry of the wheel expiring after 'after'.
+*/
+static _TimeoutEntry *
+_wheel_next(_TimerWheel *w, time_t after)
+{
+    _wheel_advance(w, after);
+
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        int shift = WHEEL_BITS * level;
+        guint64 ahead = w->occupied[level] & _bits_above((w->now >> shift) & WHEEL_MASK);
+
+        if (ahead)
+        {
+            GQueue *list = &w->slot[level][_lowest_bit(ahead)];
+
+            /* level 0 slots are one second wide */
+            return level == 0 ? list->head->data : _list_min(list);
+        }
+    }
+
+    return _list_min(&w->overflow);
+}
+
+/**
+* @brief Adjust the number of entries of an application.
+*/
+static void
+_app_count_add(const char *app_id, int delta)
+{
+    guint count = GPOINTER_TO_UINT(g_hash_table_lookup(queue.per_app, app_id)) + delta;
+
+    if (count)
+    {
+        g_hash_table_replace(queue.per_app, g_strdup(app_id), GUINT_TO_POINTER(count));
+    }
+    else
+    {
+        g_hash_table_remove(queue.per_app, app_id);
+    }
+}
+
+static void
+_entry_unlink(_TimeoutEntry *e)
+{
+    _app_count_add(e->app_id, -1);
+
+    if (e->wakeup)
+    {
+        g_sequence_remove(e->iter);
+    }
+    else
+    {
+        _wheel_unlink(&queue.wheel[e->calendar], e);
+    }
+
+    g_hash_table_remove(queue.entries, e);
+}
+
+void
+timeout_queue_init(void)
+{
+    if (queue.entries)
+    {
+        return;
+    }
+
+    /* the sequences don't own entries, the hash table does */
+    queue.entries = g_hash_table_new_full(_entry_hash, _entry_equal,
+                                          (GDestroyNotify)_entry_free, NULL);
+    queue.per_app = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    for (int calendar = 0; calendar < 2; calendar++)
+    {
+        queue.seq[calendar] = g_sequence_new(NULL);
+    }
+}
+
+void
+timeout_queue_clear(void)
+{
+    if (!queue.entries)
+    {
+        return;
+    }
+
+    g_mutex_lock(&queue_lock);
+
+    for (int calendar = 0; calendar < 2; calendar++)
+    {
+        GSequence *seq = queue.seq[calendar];
+
+        g_sequence_remove_range(g_sequence_get_begin_iter(seq),
+                                g_sequence_get_end_iter(seq));
+
+        /* wheel links live in the entries */
+        memset(&queue.wheel[calendar], 0, sizeof(queue.wheel[calendar]));
+    }
+
+    g_hash_table_remove_all(queue.entries);
+    g_hash_table_remove_all(queue.per_app);
+
+    g_mutex_unlock(&queue_lock);
+}
+
+void
+timeout_queue_put(const char *app_id, const char *key, bool public_bus,
+                  bool wakeup, bool calendar, time_t expiry, time_t window)
+{
+    _TimeoutEntry lookup =
+    {
+        .app_id = (char *) (app_id ? : ""),
+        .key = (char *) (key ? : ""),
+        .public_bus = public_bus,
+    };
+
+    g_mutex_lock(&queue_lock);
+
+    _TimeoutEntry *e = g_hash_table_lookup(queue.entries, &lookup);
+
+    if (e)
+    {
+        _entry_unlink(e);
+    }
+
+    e = g_new0(_TimeoutEntry, 1);
+    e->app_id = g_strdup(lookup.app_id);
+    e->key = g_strdup(lookup.key);
+    e->public_bus = public_bus;
+    e->wakeup = wakeup;
+    e->calendar = calendar;
+    e->expiry = expiry;
+    e->window = window;
+
+    if (wakeup)
+    {
+        e->iter = g_sequence_insert_sorted(queue.seq[calendar], e,
+                                           (GCompareDataFunc)_entry_cmp_func, NULL);
+    }
+    else
+    {
+        _wheel_link(&queue.wheel[calendar], e);
+    }
+
+    g_hash_table_insert(queue.entries, e, e);
+    _app_count_add(e->app_id, 1);
+
+    g_mutex_unlock(&queue_lock);
+}
+
+bool
+timeout_queue_remove(const char *app_id, const char *key, bool public_bus)
+{
+    _TimeoutEntry lookup =
+    {
+        .app_id = (char *) (app_id ? : ""),
+        .key = (char *) (key ? : ""),
+        .public_bus = public_bus,
+    };
+
+    g_mutex_lock(&queue_lock);
+
+    _TimeoutEntry *e = g_hash_table_lookup(queue.entries, &lookup);
+
+    if (e)
+    {
+        _entry_unlink(e);
+    }
+
+    g_mutex_unlock(&queue_lock);
+
+    return e != NULL;
+}
+
+bool
+timeout_queue_contains(const char *app_id, const char *key, bool public_bus)
+{
+    _TimeoutEntry lookup =
+    {
+        .app_id = (char *) (app_id ? : ""),
+        .key = (char *) (key ? : ""),
+        .public_bus = public_bus,
+    };
+    bool found;
+
+    if (!queue.entries)
+    {
+        return false;
+    }
+
+    g_mutex_lock(&queue_lock);
+    found = g_hash_table_contains(queue.entries, &lookup);
+    g_mutex_unlock(&queue_lock);
+
+    return found;
+}
+
+guint
+timeout_queue_app_count(const char *app_id)
+{
+    guint count;
+
+    if (!queue.per_app)
+    {
+        return 0;
+    }
+
+    g_mutex_lock(&queue_lock);
+    count = GPOINTER_TO_UINT(g_hash_table_lookup(queue.per_app, app_id ? : ""));
+    g_mutex_unlock(&queue_lock);
+
+    return count;
+}
+
+void
+timeout_queue_foreach_app(TimeoutQueueAppFunc func, void *data)
+{
+    GHashTableIter iter;
+    gpointer app_id, count;
+
+    if (!queue.per_app)
+    {
+        return;
+    }
+
+    g_mutex_lock(&queue_lock);
+
+    g_hash_table_iter_init(&iter, queue.per_app);
+
+    while (g_hash_table_iter_next(&iter, &app_id, &count))
+    {
+        func(app_id, GPOINTER_TO_UINT(count), data);
+    }
+
+    g_mutex_unlock(&queue_lock);
+}
+
+void
+timeout_queue_set_drift(time_t drift)
+{
+    g_mutex_lock(&queue_lock);
+    queue.drift = drift;
+    g_mutex_unlock(&queue_lock);
+}
+
+/**
+* @brief First entry of 'seq' expiring after 'after'.
+*
+* Expired entries are removed by the expiry pass, so this is normally the
+* head of the sequence.
+*/
+static _TimeoutEntry *
+_sequence_next(GSequence *seq, time_t after)
+{
+    GSequenceIter *iter = g_sequence_get_begin_iter(seq);
+
+    while (!g_sequence_iter_is_end(iter))
+    {
+        _TimeoutEntry *e = g_sequence_get(iter);
+
+        if (_entry_wall_expiry(e) > after)
+        {
+            return e;
+        }
+
+        iter = g_sequence_iter_next(iter);
+    }
+
+    return NULL;
+}
+
+bool
+timeout_queue_next(bool wakeup_only, time_t after, time_t *expiry,
+                   gchar **app_id, gchar **key)
+{
+    g_return_val_if_fail(expiry != NULL, false);
+
+    if (!queue.entries)
+    {
+        return false;
+    }
+
+    g_mutex_lock(&queue_lock);
+
+    _TimeoutEntry *next = NULL;
+
+    for (int calendar = 0; calendar < 2; calendar++)
+    {
+        _TimeoutEntry *candidate[2] =
+        {
+            _sequence_next(queue.seq[calendar], after),
+            wakeup_only ? NULL :
+            _wheel_next(&queue.wheel[calendar], calendar ? after : after - queue.drift),
+        };
+
+        for (int i = 0; i < 2; i++)
+        {
+            _TimeoutEntry *e = candidate[i];
+
+            if (e && (!next || _entry_wall_expiry(e) < _entry_wall_expiry(next)))
+            {
+                next = e;
+            }
+        }
+    }
+
+    if (next)
+    {
+        *expiry = _entry_wall_expiry(next);
+
+        if (app_id)
+        {
+            *app_id = g_strdup(next->app_id);
+        }
+
+        if (key)
+        {
+            *key = g_strdup(next->key);
+        }
+    }
+
+    g_mutex_unlock(&queue_lock);
+
+    return next != NULL;
+}
+
+bool
+timeout_queue_next_timer(time_t after, time_t *expiry)
+{
+    g_return_val_if_fail(expiry != NULL, false);
+
+    if (!queue.entries)
+    {
+        return false;
+    }
+
+    g_mutex_lock(&queue_lock);
+
+    _TimeoutEntry *next = NULL;
+
+    for (int calendar = 0; calendar < 2; calendar++)
+    {
+        _TimeoutEntry *e = _wheel_next(&queue.wheel[calendar],
+                                       calendar ? after : after - queue.drift);
+
+        if (e && (!next || _entry_wall_expiry(e) < _entry_wall_expiry(next)))
+        {
+            next = e;
+        }
+    }
+
+    if (next)
+    {
+        *expiry = _entry_wall_expiry(next);
+    }
+
+    g_mutex_unlock(&queue_lock);
+
+    return next != NULL;
+}
+
+bool
+timeout_queue_next_wake(time_t after, time_t *wake, guint *covers,
+                        gchar **app_id, gchar **key)
+{
+    g_return_val_if_fail(wake != NULL, false);
+
+    if (!queue.entries)
+    {
+        return false;
+    }
+
+    g_mutex_lock(&queue_lock);
+
+    GSequenceIter *iter[2] =
+    {
+        g_sequence_get_begin_iter(queue.seq[0]),
+        g_sequence_get_begin_iter(queue.seq[1]),
+    };
+    _TimeoutEntry *first = NULL;    /* entry with the earliest deadline */
+    time_t deadline = 0, last = 0;
+    guint distinct = 0;
+
+    /* Walk wakeup timeouts of both time domains in wall time order. The
+     * deadline only shrinks, and everything expiring before it is served
+     * by the same wake, so stop at the first expiry past it. */
+    for (;;)
+    {
+        _TimeoutEntry *e = NULL;
+        int from = 0;
+
+        for (int calendar = 0; calendar < 2; calendar++)
+        {
+            if (!g_sequence_iter_is_end(iter[calendar]))
+            {
+                _TimeoutEntry *c = g_sequence_get(iter[calendar]);
+
+                if (!e || _entry_wall_expiry(c) < _entry_wall_expiry(e))
+                {
+                    e = c;
+                    from = calendar;
+                }
+            }
+        }
+
+        if (!e)
+        {
+            break;
+        }
+
+        iter[from] = g_sequence_iter_next(iter[from]);
+
+        time_t expiry = _entry_wall_expiry(e);
+
+        if (expiry <= after)
+        {
+            continue;
+        }
+
+        if (first && expiry > deadline)
+        {
+            break;
+        }
+
+        if (!distinct || expiry != last)
+        {
+            distinct++;
+            last = expiry;
+        }
+
+        if (!first || expiry + e->window < deadline)
+        {
+            first = e;
+            deadline = expiry + e->window;
+        }
+    }
+
+    if (first)
+    {
+        *wake = deadline;
+
+        if (covers)
+        {
+            *covers = distinct;
+        }
+
+        if (app_id)
+        {
+            *app_id = g_strdup(first->app_id);
+        }
+
+        if (key)
+        {
+            *key = g_strdup(first->key);
+        }
+    }
+
+    g_mutex_unlock(&queue_lock);
+
+    return first != NULL;
+}
+
+guint
+timeout_queue_size(void)
+{
+    guint size;
+
+    if (!queue.entries)
+    {
+        return 0;
+    }
+
+    g_mutex_lock(&queue_lock);
+    size = g_hash_table_size(queue.entries);
+    g_mutex_unlock(&queue_lock);
+
+    return size;
+}
+
+/* @} END OF NewInterface */
@@ -0,0 +1,76 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+* @file timeout_store.c
+*
+* @brief Timeout storage engine selection.
+*
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "logging.h"
+#include "timeout_store.h"
+
+static const TimeoutStore *engines[] =
+{
+    &timeout_store_sqlite,
+    &timeout_store_log,
+};
+
+const TimeoutStore *
+timeout_store_open(const char *name, const char *dir)
+{
+    const TimeoutStore *store = &timeout_store_sqlite;
+
+    for (int i = 0; i < G_N_ELEMENTS(engines); i++)
+    {
+        if (name && strcmp(name, engines[i]->name) == 0)
+        {
+            store = engines[i];
+            break;
+        }
+    }
+
+    if (!name || strcmp(name, store->name) != 0)
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMEOUT_STORE_ERR, 1, PMLOGKS("Storage", name ? : "(null)"),
+                          "unknown timeout storage, using sqlite");
+    }
+
+    g_mkdir_with_parents(dir, S_IRWXU);
+
+    if (!store->open(dir))
+    {
+        SLEEPDLOG_ERROR(MSGID_TIMEOUT_STORE_ERR, 1, PMLOGKS("Storage", store->name),
+                        "could not open timeout storage");
+        return NULL;
+    }
+
+    SLEEPDLOG_DEBUG("using %s timeout storage", store->name);
+    return store;
+}
+
+time_t
+timeout_next_repeat(time_t expiry, time_t repeat, time_t now)
+{
+    return expiry + repeat * ((now - expiry) / repeat + 1);
+}
@@ -0,0 +1,990 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+* @file timeout_store_log.c
+*
+* @brief Timeout storage in an append-only log, SysTimeouts.log.
+*
+* All timeouts are kept in memory. Every committed change is appended to
+* the log as one line per timeout:
+*
+*   +	id	public_bus	wakeup	calendar	expiry	window	repeat	duration_ms	app_id	key	uri	params	activity_id
+*   -	app_id	key	public_bus
+*
+* Fields are separated by tabs, strings are escaped with g_strescape(). The
+* lines of a transaction are followed by a "." line and written with a single
+* write(). Replaying the log from the start rebuilds the timeouts. Once the
+* log holds mostly superseded lines it is compacted: a snapshot of the live
+* timeouts is written next to it and renamed over it.
+*
+* A transaction cut short by a crash or power loss has no "." line and is
+* dropped on load.
+*/
+
+#include <time.h>
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "logging.h"
+#include "config.h"
+
+#include "reference_time.h"
+#include "timeout_store.h"
+
+#define TIMEOUT_LOG_NAME "SysTimeouts.log"
+
+/* Compact once the log holds at least this many lines, and more than twice
+ * as many as there are live timeouts. */
+#define TIMEOUT_LOG_COMPACT_MIN 256
+
+/* ends the lines of each transaction */
+#define TIMEOUT_LOG_COMMIT "."
+
+#define TIMEOUT_LOG_PUT_FIELDS 14
+#define TIMEOUT_LOG_DELETE_FIELDS 4
+
+/**
+* @brief One live timeout.
+*/
+typedef struct
+{
+    gint64                id;
+    gchar                *hash_key;
+    _AlarmTimeoutNonConst timeout;
+    GSequenceIter        *iter;      /*< in by_expiry[timeout.calendar] */
+} _LogRecord;
+
+static struct
+{
+    gchar      *path;
+    int         fd;
+
+    GHashTable *records;        /*< hash key -> _LogRecord */
+    GSequence  *by_expiry[2];   /*< _LogRecord by (expiry, id), relative and calendar */
+    gint64      next_id;
+
+    GRecMutex   lock;
+    int         txn_depth;
+    GString    *pending;        /*< lines of the open transaction */
+    guint       pending_lines;
+
+    guint       log_lines;      /*< timeout lines in the file, live or superseded */
+    gint64      log_bytes;
+    unsigned long compactions;
+    unsigned long write_errors;
+} store_log = { .fd = -1 };
+
+static gchar *
+_log_hash_key(const char *app_id, const char *key, bool public_bus)
+{
+    /* the length prefix keeps ("a", "bc") apart from ("ab", "c") */
+    return g_strdup_printf("%d:%zu:%s%s", public_bus, strlen(app_id), app_id, key);
+}
+
+static gint
+_log_record_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const _LogRecord *ra = a, *rb = b;
+
+    if (ra->timeout.expiry != rb->timeout.expiry)
+    {
+        return ra->timeout.expiry < rb->timeout.expiry ? -1 : 1;
+    }
+
+    return ra->id < rb->id ? -1 : ra->id > rb->id;
+}
+
+static void
+_log_record_free(gpointer data)
+{
+    _LogRecord *rec = data;
+
+    g_free(rec->hash_key);
+    g_free(rec->timeout.app_id);
+    g_free(rec->timeout.key);
+    g_free(rec->timeout.uri);
+    g_free(rec->timeout.params);
+    g_free(rec->timeout.activity_id);
+    g_free(rec);
+}
+
+static _LogRecord *
+_log_record_new(gint64 id, const _AlarmTimeout *timeout)
+{
+    _LogRecord *rec = g_new0(_LogRecord, 1);
+
+    rec->id = id;
+    rec->timeout.app_id = g_strdup(timeout->app_id ? : "");
+    rec->timeout.key = g_strdup(timeout->key ? : "");
+    rec->timeout.uri = g_strdup(timeout->uri ? : "");
+    rec->timeout.params = g_strdup(timeout->params ? : "");
+    rec->timeout.activity_id = g_strdup(timeout->activity_id ? : "");
+    rec->timeout.activity_duration_ms = timeout->activity_duration_ms;
+    rec->timeout.public_bus = timeout->public_bus;
+    rec->timeout.wakeup = timeout->wakeup;
+    rec->timeout.calendar = timeout->calendar;
+    rec->timeout.expiry = timeout->expiry;
+    rec->timeout.window = timeout->window;
+    rec->timeout.repeat = timeout->repeat;
+    rec->hash_key = _log_hash_key(rec->timeout.app_id, rec->timeout.key,
+                                  rec->timeout.public_bus);
+
+    return rec;
+}
+
+/**
+* @brief Const view of a record, as handed to callers.
+*/
+static void
+_log_record_view(const _LogRecord *rec, _AlarmTimeout *timeout)
+{
+    timeout->table_id = NULL;
+    timeout->app_id = rec->timeout.app_id;
+    timeout->key = rec->timeout.key;
+    timeout->uri = rec->timeout.uri;
+    timeout->params = rec->timeout.params;
+    timeout->activity_id = rec->timeout.activity_id;
+    timeout->activity_duration_ms = rec->timeout.activity_duration_ms;
+    timeout->public_bus = rec->timeout.public_bus;
+    timeout->wakeup = rec->timeout.wakeup;
+    timeout->calendar = rec->timeout.calendar;
+    timeout->expiry = rec->timeout.expiry;
+    timeout->window = rec->timeout.window;
+    timeout->repeat = rec->timeout.repeat;
+}
+
+static void
+_log_remove(_LogRecord *rec)
+{
+    g_sequence_remove(rec->iter);
+    /* frees rec */
+    g_hash_table_remove(store_log.records, rec->hash_key);
+}
+
+/**
+* @brief Add a record, replacing the one with the same key.
+*/
+static void
+_log_insert(_LogRecord *rec)
+{
+    _LogRecord *old = g_hash_table_lookup(store_log.records, rec->hash_key);
+
+    if (old)
+    {
+        _log_remove(old);
+    }
+
+    g_hash_table_insert(store_log.records, rec->hash_key, rec);
+    rec->iter = g_sequence_insert_sorted(store_log.by_expiry[rec->timeout.calendar],
+                                         rec, _log_record_cmp, NULL);
+
+    if (rec->id >= store_log.next_id)
+    {
+        store_log.next_id = rec->id + 1;
+    }
+}
+
+static void
+_log_format_put(GString *out, const _LogRecord *rec)
+{
+    const _AlarmTimeoutNonConst *t = &rec->timeout;
+    gchar *app_id = g_strescape(t->app_id, NULL);
+    gchar *key = g_strescape(t->key, NULL);
+    gchar *uri = g_strescape(t->uri, NULL);
+    gchar *params = g_strescape(t->params, NULL);
+    gchar *activity_id = g_strescape(t->activity_id, NULL);
+
+    g_string_append_printf(out,
+                           "+\t%" G_GINT64_FORMAT "\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%d\t%s\t%s\t%s\t%s\t%s\n",
+                           rec->id, t->public_bus, t->wakeup, t->calendar,
+                           (long long) t->expiry, (long long) t->window, (long long) t->repeat,
+                           t->activity_duration_ms, app_id, key, uri, params, activity_id);
+
+    g_free(app_id);
+    g_free(key);
+    g_free(uri);
+    g_free(params);
+    g_free(activity_id);
+}
+
+static void
+_log_format_delete(GString *out, const _LogRecord *rec)
+{
+    gchar *app_id = g_strescape(rec->timeout.app_id, NULL);
+    gchar *key = g_strescape(rec->timeout.key, NULL);
+
+    g_string_append_printf(out, "-\t%s\t%s\t%d\n", app_id, key,
+                           rec->timeout.public_bus);
+
+    g_free(app_id);
+    g_free(key);
+}
+
+/**
+* @brief Apply one line of the log to the in-memory timeouts.
+*
+* @retval false if the line is malformed
+*/
+static bool
+_log_apply(const char *line)
+{
+    gchar **fields = g_strsplit(line, "\t", 0);
+    guint n = g_strv_length(fields);
+    bool ok = true;
+
+    if (n == TIMEOUT_LOG_PUT_FIELDS && strcmp(fields[0], "+") == 0)
+    {
+        _AlarmTimeout timeout;
+        gchar *strings[5];
+
+        for (int i = 0; i < 5; i++)
+        {
+            strings[i] = g_strcompress(fields[9 + i]);
+        }
+
+        timeout.table_id = NULL;
+        timeout.public_bus = atoi(fields[2]);
+        timeout.wakeup = atoi(fields[3]);
+        timeout.calendar = atoi(fields[4]) != 0;
+        timeout.expiry = g_ascii_strtoll(fields[5], NULL, 10);
+        timeout.window = g_ascii_strtoll(fields[6], NULL, 10);
+        timeout.repeat = g_ascii_strtoll(fields[7], NULL, 10);
+        timeout.activity_duration_ms = atoi(fields[8]);
+        timeout.app_id = strings[0];
+        timeout.key = strings[1];
+        timeout.uri = strings[2];
+        timeout.params = strings[3];
+        timeout.activity_id = strings[4];
+
+        _log_insert(_log_record_new(g_ascii_strtoll(fields[1], NULL, 10), &timeout));
+
+        for (int i = 0; i < 5; i++)
+        {
+            g_free(strings[i]);
+        }
+    }
+    else if (n == TIMEOUT_LOG_DELETE_FIELDS && strcmp(fields[0], "-") == 0)
+    {
+        gchar *app_id = g_strcompress(fields[1]);
+        gchar *key = g_strcompress(fields[2]);
+        gchar *hash_key = _log_hash_key(app_id, key, atoi(fields[3]));
+        _LogRecord *rec = g_hash_table_lookup(store_log.records, hash_key);
+
+        if (rec)
+        {
+            _log_remove(rec);
+        }
+
+        g_free(hash_key);
+        g_free(key);
+        g_free(app_id);
+    }
+    else
+    {
+        ok = false;
+    }
+
+    g_strfreev(fields);
+    return ok;
+}
+
+static bool
+_log_write_all(int fd, const char *buf, gsize len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        buf += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+static bool
+_log_sync(void)
+{
+    /* follows the durability chosen for the database */
+    return g_strcmp0(gSleepConfig.db_synchronous, "off") == 0 ||
+           fdatasync(store_log.fd) == 0;
+}
+
+static bool
+_log_reopen(void)
+{
+    if (store_log.fd >= 0)
+    {
+        close(store_log.fd);
+    }
+
+    store_log.fd = open(store_log.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        S_IRUSR | S_IWUSR);
+
+    if (store_log.fd < 0)
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMEOUT_LOG_ERR, 2, PMLOGKS(PATH, store_log.path),
+                          PMLOGKS(ERRTEXT, g_strerror(errno)), "could not open timeout log");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+* @brief Replace the log with a snapshot of the live timeouts.
+*/
+static bool
+_log_compact(void)
+{
+    GHashTableIter iter;
+    gpointer value;
+    GError *error = NULL;
+    GString *snapshot = g_string_sized_new(128 * g_hash_table_size(store_log.records) + 1);
+
+    g_hash_table_iter_init(&iter, store_log.records);
+
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        _log_format_put(snapshot, value);
+    }
+
+    g_string_append(snapshot, TIMEOUT_LOG_COMMIT "\n");
+
+    /* written to a temporary file, synced and renamed over the log */
+    if (!g_file_set_contents(store_log.path, snapshot->str, snapshot->len, &error))
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMEOUT_LOG_ERR, 2, PMLOGKS(PATH, store_log.path),
+                          PMLOGKS(ERRTEXT, error->message), "could not compact timeout log");
+        g_error_free(error);
+        g_string_free(snapshot, TRUE);
+        return false;
+    }
+
+    store_log.log_lines = g_hash_table_size(store_log.records);
+    store_log.log_bytes = snapshot->len;
+    store_log.compactions++;
+    g_string_free(snapshot, TRUE);
+
+    SLEEPDLOG_DEBUG("compacted timeout log to %u timeouts", store_log.log_lines);
+
+    return _log_reopen();
+}
+
+/**
+* @brief Rebuild the in-memory timeouts from the log.
+*
+* @param torn set to true if the log ended in an incomplete transaction or
+*        held malformed lines
+*/
+static bool
+_log_load(bool *torn)
+{
+    gchar *contents;
+    gsize length;
+    GError *error = NULL;
+
+    *torn = false;
+
+    g_hash_table_remove_all(store_log.records);
+    store_log.log_lines = 0;
+    store_log.log_bytes = 0;
+
+    if (!g_file_get_contents(store_log.path, &contents, &length, &error))
+    {
+        bool missing = g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+
+        if (!missing)
+        {
+            SLEEPDLOG_WARNING(MSGID_TIMEOUT_LOG_ERR, 2, PMLOGKS(PATH, store_log.path),
+                              PMLOGKS(ERRTEXT, error->message), "could not read timeout log");
+        }
+
+        g_error_free(error);
+        return missing;
+    }
+
+    char *line = contents;
+    char *end;
+    GPtrArray *txn = g_ptr_array_new();
+
+    while ((end = memchr(line, '\n', contents + length - line)) != NULL)
+    {
+        *end = '\0';
+
+        if (strcmp(line, TIMEOUT_LOG_COMMIT) == 0)
+        {
+            for (guint i = 0; i < txn->len; i++)
+            {
+                if (!_log_apply(g_ptr_array_index(txn, i)))
+                {
+                    *torn = true;
+                }
+            }
+
+            store_log.log_lines += txn->len;
+            g_ptr_array_set_size(txn, 0);
+        }
+        else
+        {
+            g_ptr_array_add(txn, line);
+        }
+
+        line = end + 1;
+    }
+
+    /* lines after the last commit mark belong to a transaction that was cut
+     * short */
+    if (txn->len || line != contents + length)
+    {
+        *torn = true;
+    }
+
+    g_ptr_array_free(txn, TRUE);
+    store_log.log_bytes = length;
+    g_free(contents);
+
+    return true;
+}
+
+/**
+* @brief Bring memory back in line with the log after a failed transaction.
+*/
+static void
+_log_reload(void)
+{
+    bool torn;
+
+    for (int i = 0; i < 2; i++)
+    {
+        g_sequence_remove_range(g_sequence_get_begin_iter(store_log.by_expiry[i]),
+                                g_sequence_get_end_iter(store_log.by_expiry[i]));
+    }
+
+    _log_load(&torn);
+}
+
+static bool
+_log_open(const char *dir)
+{
+    bool torn;
+
+    store_log.path = g_build_filename(dir, TIMEOUT_LOG_NAME, NULL);
+    store_log.records = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                              _log_record_free);
+    store_log.by_expiry[0] = g_sequence_new(NULL);
+    store_log.by_expiry[1] = g_sequence_new(NULL);
+    store_log.pending = g_string_new(NULL);
+
+    if (!_log_load(&torn))
+    {
+        return false;
+    }
+
+    SLEEPDLOG_DEBUG("loaded %u timeouts from %u log lines",
+                    g_hash_table_size(store_log.records), store_log.log_lines);
+
+    /* rewrite a damaged log right away so that appends start on a clean line */
+    if (torn)
+    {
+        SLEEPDLOG_WARNING(MSGID_TIMEOUT_LOG_ERR, 1, PMLOGKS(PATH, store_log.path),
+                          "timeout log was damaged, dropped its incomplete tail");
+        return _log_compact();
+    }
+
+    return _log_reopen();
+}
+
+static void
+_log_flush(void)
+{
+    if (store_log.fd < 0)
+    {
+        return;
+    }
+
+    g_rec_mutex_lock(&store_log.lock);
+
+    /* start the next boot from a snapshot */
+    if (store_log.log_lines > g_hash_table_size(store_log.records))
+    {
+        _log_compact();
+    }
+    else
+    {
+        fsync(store_log.fd);
+    }
+
+    g_rec_mutex_unlock(&store_log.lock);
+}
+
+static bool
+_log_begin(void)
+{
+    if (store_log.fd < 0)
+    {
+        return false;
+    }
+
+    g_rec_mutex_lock(&store_log.lock);
+    store_log.txn_depth++;
+    return true;
+}
+
+static bool
+_log_end(bool commit)
+{
+    bool ok = true;
+
+    if (--store_log.txn_depth == 0 && store_log.pending->len)
+    {
+        if (commit)
+        {
+            g_string_append(store_log.pending, TIMEOUT_LOG_COMMIT "\n");
+
+            ok = _log_write_all(store_log.fd, store_log.pending->str,
+                                store_log.pending->len) && _log_sync();
+
+            if (ok)
+            {
+                store_log.log_lines += store_log.pending_lines;
+                store_log.log_bytes += store_log.pending->len;
+            }
+            else
+            {
+                SLEEPDLOG_WARNING(MSGID_TIMEOUT_LOG_ERR, 2, PMLOGKS(PATH, store_log.path),
+                                  PMLOGKS(ERRTEXT, g_strerror(errno)), "could not append to timeout log");
+                store_log.write_errors++;
+
+                /* drop whatever part of the transaction made it to the file */
+                if (ftruncate(store_log.fd, store_log.log_bytes) != 0)
+                {
+                    SLEEPDLOG_WARNING(MSGID_TIMEOUT_LOG_ERR, 2, PMLOGKS(PATH, store_log.path),
+                                      PMLOGKS(ERRTEXT, g_strerror(errno)), "could not truncate timeout log");
+                }
+            }
+        }
+
+        g_string_truncate(store_log.pending, 0);
+        store_log.pending_lines = 0;
+
+        if (!commit || !ok)
+        {
+            _log_reload();
+        }
+        else if (store_log.log_lines >= TIMEOUT_LOG_COMPACT_MIN &&
+                 store_log.log_lines > 2 * g_hash_table_size(store_log.records))
+        {
+            _log_compact();
+        }
+    }
+
+    g_rec_mutex_unlock(&store_log.lock);
+    return ok;
+}
+
+static bool
+_log_commit(void)
+{
+    return _log_end(true);
+}
+
+static bool
+_log_rollback(void)
+{
+    _log_end(false);
+    return true;
+}
+
+static bool
+_log_put(const _AlarmTimeout *timeout, bool keep_existing, bool *kept)
+{
+    gchar *hash_key;
+    _LogRecord *old, *rec;
+
+    if (!_log_begin())
+    {
+        return false;
+    }
+
+    hash_key = _log_hash_key(timeout->app_id ? : "", timeout->key, timeout->public_bus);
+    old = g_hash_table_lookup(store_log.records, hash_key);
+    g_free(hash_key);
+
+    *kept = old && keep_existing;
+
+    if (!*kept)
+    {
+        /* a replaced timeout keeps its position for timeouts/list */
+        rec = _log_record_new(old ? old->id : store_log.next_id, timeout);
+        _log_insert(rec);
+        _log_format_put(store_log.pending, rec);
+        store_log.pending_lines++;
+    }
+
+    return _log_commit();
+}
+
+static bool
+_log_get(_AlarmTimeoutNonConst *timeout, const char *app_id,
+         const char *key, bool public_bus)
+{
+    gchar *hash_key = _log_hash_key(app_id, key, public_bus);
+    _LogRecord *rec;
+
+    g_rec_mutex_lock(&store_log.lock);
+
+    rec = store_log.records ? g_hash_table_lookup(store_log.records, hash_key) : NULL;
+
+    if (rec)
+    {
+        *timeout = rec->timeout;
+        timeout->table_id = g_strdup_printf("%" G_GINT64_FORMAT, rec->id);
+        timeout->app_id = g_strdup(rec->timeout.app_id);
+        timeout->key = g_strdup(rec->timeout.key);
+        timeout->uri = g_strdup(rec->timeout.uri);
+        timeout->params = g_strdup(rec->timeout.params);
+        timeout->activity_id = g_strdup(rec->timeout.activity_id);
+    }
+
+    g_rec_mutex_unlock(&store_log.lock);
+
+    g_free(hash_key);
+    return rec != NULL;
+}
+
+static bool
+_log_delete(const char *app_id, const char *key, bool public_bus)
+{
+    gchar *hash_key;
+    _LogRecord *rec;
+
+    if (!_log_begin())
+    {
+        return false;
+    }
+
+    hash_key = _log_hash_key(app_id, key, public_bus);
+    rec = g_hash_table_lookup(store_log.records, hash_key);
+    g_free(hash_key);
+
+    if (rec)
+    {
+        _log_format_delete(store_log.pending, rec);
+        store_log.pending_lines++;
+        _log_remove(rec);
+    }
+
+    return _log_commit();
+}
+
+/**
+* @brief First record of 'seq' after (expiry, id).
+*/
+static GSequenceIter *
+_log_search(GSequence *seq, time_t expiry, gint64 id)
+{
+    _LogRecord probe = { .id = id };
+
+    probe.timeout.expiry = expiry;
+    return g_sequence_search(seq, &probe, _log_record_cmp, NULL);
+}
+
+static bool
+_log_scan_due(time_t now, time_t now_relative, TimeoutStoreFunc func,
+              void *data)
+{
+    GSequenceIter *cal, *rel;
+    GPtrArray *due;
+    _AlarmTimeout timeout;
+
+    if (!_log_begin())
+    {
+        return false;
+    }
+
+    due = g_ptr_array_new();
+    cal = g_sequence_get_begin_iter(store_log.by_expiry[1]);
+    rel = g_sequence_get_begin_iter(store_log.by_expiry[0]);
+
+    /* merge both domains in wall time order */
+    for (;;)
+    {
+        _LogRecord *c = NULL, *r = NULL;
+
+        if (!g_sequence_iter_is_end(cal))
+        {
+            c = g_sequence_get(cal);
+            c = c->timeout.expiry <= now ? c : NULL;
+        }
+
+        if (!g_sequence_iter_is_end(rel))
+        {
+            r = g_sequence_get(rel);
+            r = r->timeout.expiry <= now_relative ? r : NULL;
+        }
+
+        if (!c && !r)
+        {
+            break;
+        }
+
+        bool take_cal = c && (!r || c->timeout.expiry <=
+                              r->timeout.expiry + (now - now_relative));
+        _LogRecord *rec = take_cal ? c : r;
+
+        _log_record_view(rec, &timeout);
+        func(&timeout, data);
+        g_ptr_array_add(due, rec);
+
+        if (take_cal)
+        {
+            cal = g_sequence_iter_next(cal);
+        }
+        else
+        {
+            rel = g_sequence_iter_next(rel);
+        }
+    }
+
+    for (guint i = 0; i < due->len; i++)
+    {
+        _LogRecord *rec = g_ptr_array_index(due, i);
+
+        if (rec->timeout.repeat > 0)
+        {
+            rec->timeout.expiry = timeout_next_repeat(rec->timeout.expiry,
+                                                      rec->timeout.repeat,
+                                                      rec->timeout.calendar ? now : now_relative);
+            g_sequence_sort_changed(rec->iter, _log_record_cmp, NULL);
+            _log_format_put(store_log.pending, rec);
+        }
+        else
+        {
+            _log_format_delete(store_log.pending, rec);
+            _log_remove(rec);
+        }
+
+        store_log.pending_lines++;
+    }
+
+    g_ptr_array_free(due, TRUE);
+
+    return _log_commit();
+}
+
+static bool
+_log_scan_all(TimeoutStoreFunc func, void *data)
+{
+    GHashTableIter iter;
+    gpointer value;
+    _AlarmTimeout timeout;
+
+    if (!store_log.records)
+    {
+        return false;
+    }
+
+    g_rec_mutex_lock(&store_log.lock);
+
+    g_hash_table_iter_init(&iter, store_log.records);
+
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        _log_record_view(value, &timeout);
+        func(&timeout, data);
+    }
+
+    g_rec_mutex_unlock(&store_log.lock);
+    return true;
+}
+
+static bool
+_log_next_wakeup(time_t after, time_t *expiry)
+{
+    bool found = false;
+
+    if (!store_log.records)
+    {
+        return false;
+    }
+
+    g_rec_mutex_lock(&store_log.lock);
+
+    for (int calendar = 0; calendar < 2; calendar++)
+    {
+        time_t offset = calendar ? 0 : reference_drift();
+        GSequenceIter *it = _log_search(store_log.by_expiry[calendar], after - offset,
+                                        G_MAXINT64);
+
+        for (; !g_sequence_iter_is_end(it); it = g_sequence_iter_next(it))
+        {
+            _LogRecord *rec = g_sequence_get(it);
+
+            if (rec->timeout.wakeup)
+            {
+                if (!found || rec->timeout.expiry + offset < *expiry)
+                {
+                    *expiry = rec->timeout.expiry + offset;
+                    found = true;
+                }
+
+                break;
+            }
+        }
+    }
+
+    g_rec_mutex_unlock(&store_log.lock);
+    return found;
+}
+
+/**
+* @brief Next record at or after 'it' matching the filters of a list query.
+*
+* @retval NULL past the end of the page range
+*/
+static _LogRecord *
+_log_list_match(GSequenceIter **it, const TimeoutStoreListQuery *query,
+                time_t offset)
+{
+    for (; !g_sequence_iter_is_end(*it); *it = g_sequence_iter_next(*it))
+    {
+        _LogRecord *rec = g_sequence_get(*it);
+
+        if (rec->timeout.expiry > query->until - offset)
+        {
+            break;
+        }
+
+        if ((!query->app_id || strcmp(query->app_id, rec->timeout.app_id) == 0) &&
+                (query->wakeup < 0 || query->wakeup == rec->timeout.wakeup))
+        {
+            return rec;
+        }
+    }
+
+    return NULL;
+}
+
+static bool
+_log_list(const TimeoutStoreListQuery *query, TimeoutStoreListFunc func,
+          void *data, bool *more)
+{
+    GSequenceIter *cal, *rel;
+    _AlarmTimeout timeout;
+    time_t drift = reference_drift();
+    int count = 0;
+
+    *more = false;
+
+    if (!store_log.records)
+    {
+        return false;
+    }
+
+    g_rec_mutex_lock(&store_log.lock);
+
+    cal = _log_search(store_log.by_expiry[1], query->after, query->after_id);
+    rel = _log_search(store_log.by_expiry[0], query->after - drift, query->after_id);
+
+    for (;;)
+    {
+        _LogRecord *c = _log_list_match(&cal, query, 0);
+        _LogRecord *r = _log_list_match(&rel, query, drift);
+
+        if (!c && !r)
+        {
+            break;
+        }
+
+        if (count == query->limit)
+        {
+            *more = true;
+            break;
+        }
+
+        bool take_cal = c && (!r || c->timeout.expiry < r->timeout.expiry + drift ||
+                              (c->timeout.expiry == r->timeout.expiry + drift && c->id < r->id));
+        _LogRecord *rec = take_cal ? c : r;
+
+        _log_record_view(rec, &timeout);
+        func(&timeout, rec->timeout.expiry + (take_cal ? 0 : drift), rec->id, data);
+        count++;
+
+        if (take_cal)
+        {
+            cal = g_sequence_iter_next(cal);
+        }
+        else
+        {
+            rel = g_sequence_iter_next(rel);
+        }
+    }
+
+    g_rec_mutex_unlock(&store_log.lock);
+    return true;
+}
+
+static void
+_log_diagnostics(GString *payload)
+{
+    g_rec_mutex_lock(&store_log.lock);
+
+    g_string_append_printf(payload,
+                           ",\"log\":{\"timeouts\":%u,\"lines\":%u,\"bytes\":%lld,"
+                           "\"compactions\":%lu,\"writeErrors\":%lu}",
+                           store_log.records ? g_hash_table_size(store_log.records) : 0,
+                           store_log.log_lines, (long long) store_log.log_bytes,
+                           store_log.compactions, store_log.write_errors);
+
+    g_rec_mutex_unlock(&store_log.lock);
+}
+
+const TimeoutStore timeout_store_log =
+{
+    .name = "log",
+    .open = _log_open,
+    .flush = _log_flush,
+    .begin = _log_begin,
+    .commit = _log_commit,
+    .rollback = _log_rollback,
+    .put = _log_put,
+    .get = _log_get,
+    .delete = _log_delete,
+    .scan_due = _log_scan_due,
+    .scan_all = _log_scan_all,
+    .next_wakeup = _log_next_wakeup,
+    .list = _log_list,
+    .diagnostics = _log_diagnostics,
+};
@@ -0,0 +1,1452 @@
+// Copyright (c) 2011-2018 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+/**
+* @file timeout_store_sqlite.c
+*
+* @brief Timeout storage in an sqlite3 database, SysTimeouts.db.
+*
+*/
+
+#include <time.h>
+#include <glib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "main.h"
+#include "logging.h"
+#include "smartsql.h"
+
+#include "reference_time.h"
+#include "timeout_store.h"
+
+// This allows testing the SQL commands to add the new columns. Set to false for production code
+#define CREATE_DB_WITHOUT_ACTIVITY_COLUMNS 0
+
+#define TIMEOUT_DATABASE_NAME "SysTimeouts.db"
+
+#define DEFAULT_ACTIVITY_ID "com.webos.service.alarm.timeout_fired"
+#define TIMEOUT_KEEP_ALIVE_MS 1000
+
+static sqlite3 *timeout_db = NULL;
+
+/*
+   Database Schema.
+
+   We use an sqlite3 database to store all pending events. The schema
+   is designed so that the event list can be quickly sorted and the
+   next item to fire can be quickly read.
+
+   For calendar timeouts expiry is the absolute system time of when the
+   next event is to be fired. It is GMT, so all math performed with it
+   needs to be in GMT as well.
+
+   For relative timeouts expiry is a relative_time() value, which does not
+   follow system time changes, so those rows never have to be rewritten.
+   The wall time is expiry + reference_drift().
+
+   The schema below is the original layout; kTimeoutMigrationStrings turns
+   app_id, uri and activity_id into references into the TimeoutString
+   dictionary, since a handful of applications own nearly all timeouts and
+   repeat the same strings in every row. params is mostly different for
+   each timeout and stays in the row.
+   */
+#if CREATE_DB_WITHOUT_ACTIVITY_COLUMNS
+static const char *kSysTimeoutDatabaseCreateSchema = "\
+CREATE TABLE IF NOT EXISTS AlarmTimeout (t1key INTEGER PRIMARY KEY,\
+                                         app_id TEXT,\
+                                         key TEXT,\
+                                         uri TEXT,\
+                                         params TEXT,\
+                                         public_bus INTEGER,\
+                                         wakeup   INTEGER,\
+                                         calendar INTEGER,\
+                                         expiry DATE);";
+#else
+static const char *kSysTimeoutDatabaseCreateSchema = "\
+CREATE TABLE IF NOT EXISTS AlarmTimeout (t1key INTEGER PRIMARY KEY,\
+                                         app_id TEXT,\
+                                         key TEXT,\
+                                         uri TEXT,\
+                                         params TEXT,\
+                                         public_bus INTEGER,\
+                                         wakeup   INTEGER,\
+                                         calendar INTEGER,\
+                                         expiry DATE,\
+                                         activity_id TEXT,\
+                                         activity_duration_ms INTEGER);";
+#endif
+
+static const char *kSysTimeoutDatabaseCreateIndex = "\
+CREATE INDEX IF NOT EXISTS expiry_domain_index on AlarmTimeout (calendar, expiry);";
+
+/* superseded by expiry_domain_index */
+static const char *kSysTimeoutDatabaseDropIndex = "\
+DROP INDEX IF EXISTS expiry_index;";
+
+/*
+   Schema migrations.
+
+   PRAGMA user_version holds the number of steps below that have been
+   applied to the database. Each step runs in its own transaction. A new
+   database goes through all of them as well, which is cheap on an empty
+   table.
+
+   Steps are only ever appended.
+   */
+static const char *kTimeoutMigrationKeyIndex[] =
+{
+    /* callers without an app id used to be stored as NULL, which never
+     * matched app_id=$1 and so could not be replaced or cleared */
+    "UPDATE AlarmTimeout SET app_id='' WHERE app_id IS NULL",
+    /* keep only the newest row of each (app_id,key,public_bus) */
+    "DELETE FROM AlarmTimeout WHERE t1key NOT IN "
+    "(SELECT MAX(t1key) FROM AlarmTimeout GROUP BY app_id,key,public_bus)",
+    "CREATE UNIQUE INDEX IF NOT EXISTS timeout_key_index ON AlarmTimeout (app_id,key,public_bus)",
+    NULL
+};
+
+/* Next wakeup lookups only need wakeup rows: a partial index that also
+ * covers the columns they read, so they never touch the table. */
+static const char *kTimeoutMigrationWakeupIndex[] =
+{
+    "CREATE INDEX IF NOT EXISTS wakeup_expiry_index ON AlarmTimeout "
+    "(calendar,expiry,app_id,key,wakeup) WHERE wakeup=1",
+    NULL
+};
+
+/* Seconds a wakeup timeout may fire late so that it can share an RTC
+ * wakeup with others, see timeout_queue_next_wake(). */
+static const char *kTimeoutMigrationWakeWindow[] =
+{
+    "ALTER TABLE AlarmTimeout ADD COLUMN wake_window INTEGER NOT NULL DEFAULT 0",
+    NULL
+};
+
+/* Period of a repeating timeout, in the time domain of its expiry. */
+static const char *kTimeoutMigrationRepeat[] =
+{
+    "ALTER TABLE AlarmTimeout ADD COLUMN repeat_secs INTEGER NOT NULL DEFAULT 0",
+    NULL
+};
+
+/* Move app_id, uri and activity_id into the TimeoutString
+ * dictionary and reference them by id. SQLite can't drop columns, so the
+ * table is copied; its indexes go with the old table and are rebuilt on the
+ * reference columns. */
+static const char *kTimeoutMigrationStrings[] =
+{
+    "CREATE TABLE IF NOT EXISTS TimeoutString (id INTEGER PRIMARY KEY, value TEXT NOT NULL UNIQUE)",
+    "INSERT OR IGNORE INTO TimeoutString (value) "
+    "SELECT app_id FROM AlarmTimeout UNION SELECT COALESCE(uri,'') FROM AlarmTimeout "
+    "UNION SELECT activity_id FROM AlarmTimeout WHERE activity_id IS NOT NULL",
+    "CREATE TABLE AlarmTimeoutRef (t1key INTEGER PRIMARY KEY,"
+    "app_ref INTEGER NOT NULL,key TEXT,uri_ref INTEGER NOT NULL,params TEXT,"
+    "public_bus INTEGER,wakeup INTEGER,calendar INTEGER,expiry INTEGER,"
+    "activity_ref INTEGER,activity_duration_ms INTEGER,"
+    "wake_window INTEGER NOT NULL DEFAULT 0,repeat_secs INTEGER NOT NULL DEFAULT 0)",
+    "INSERT INTO AlarmTimeoutRef SELECT t1key,"
+    "(SELECT id FROM TimeoutString WHERE value=app_id),key,"
+    "(SELECT id FROM TimeoutString WHERE value=COALESCE(uri,'')),"
+    "COALESCE(params,''),"
+    "public_bus,wakeup,calendar,expiry,"
+    "(SELECT id FROM TimeoutString WHERE value=activity_id),activity_duration_ms,"
+    "wake_window,repeat_secs FROM AlarmTimeout",
+    "DROP TABLE AlarmTimeout",
+    "ALTER TABLE AlarmTimeoutRef RENAME TO AlarmTimeout",
+    "CREATE UNIQUE INDEX timeout_key_index ON AlarmTimeout (app_ref,key,public_bus)",
+    "CREATE INDEX expiry_domain_index ON AlarmTimeout (calendar,expiry)",
+    "CREATE INDEX wakeup_expiry_index ON AlarmTimeout "
+    "(calendar,expiry,app_ref,key,wakeup) WHERE wakeup=1",
+    NULL
+};
+
+static const char **kTimeoutMigrations[] =
+{
+    kTimeoutMigrationKeyIndex,
+    kTimeoutMigrationWakeupIndex,
+    kTimeoutMigrationWakeWindow,
+    kTimeoutMigrationRepeat,
+    kTimeoutMigrationStrings,
+};
+
+/* Databases from before the activity columns existed get them ahead of
+ * kTimeoutMigrationStrings, which copies them. */
+static const char *kTimeoutAddActivityColumns[] =
+{
+    "ALTER TABLE AlarmTimeout ADD COLUMN activity_id TEXT",
+    "ALTER TABLE AlarmTimeout ADD COLUMN activity_duration_ms INTEGER",
+    NULL
+};
+
+/* Dictionary strings no timeout refers to any more. Reference counting
+ * drops them as timeouts go; this catches anything left by a crash
+ * between a change and its commit, or by an older sleepd. Run on open. */
+static const char *kTimeoutStringsCollect = "\
+DELETE FROM TimeoutString WHERE id NOT IN (\
+SELECT app_ref FROM AlarmTimeout UNION SELECT uri_ref FROM AlarmTimeout \
+UNION SELECT activity_ref FROM AlarmTimeout WHERE activity_ref IS NOT NULL);";
+
+/*
+   Prepared statements.
+
+   Every query against AlarmTimeout is compiled once when the store is
+   opened and then reused: callers acquire the statement, bind their
+   parameters, step it and release it, which resets the statement for the
+   next user.
+
+   Statement use is serialized with a recursive lock (the expiry pass
+   steps one statement while running others), so that the database may
+   also be touched from the suspend thread.
+   */
+typedef enum
+{
+    kTimeoutStmtSelectExpired,
+    kTimeoutStmtRepeatExpired,
+    kTimeoutStmtDeleteExpired,
+    kTimeoutStmtSelectAll,
+    kTimeoutStmtInsert,
+    kTimeoutStmtInsertKeep,
+    kTimeoutStmtSelectByKey,
+    kTimeoutStmtDeleteByKey,
+    kTimeoutStmtNextWakeupCalendar,
+    kTimeoutStmtNextWakeupRelative,
+    kTimeoutStmtListCalendar,
+    kTimeoutStmtListRelative,
+    kTimeoutStmtStringAll,
+    kTimeoutStmtStringRefs,
+    kTimeoutStmtStringInsert,
+    kTimeoutStmtStringDelete,
+    kTimeoutStmtRefsByKey,
+    kTimeoutStmtBegin,
+    kTimeoutStmtCommit,
+    kTimeoutStmtRollback,
+    kTimeoutStmtLast
+} TimeoutStmt;
+
+static const char *kTimeoutStmtSql[kTimeoutStmtLast] =
+{
+    [kTimeoutStmtSelectExpired] =
+    "SELECT app_ref,key,uri_ref,params,public_bus,activity_ref,activity_duration_ms,"
+    "wakeup,calendar,expiry,wake_window,repeat_secs,expiry+(calendar=0)*($1-$2) AS wall_expiry "
+    "FROM AlarmTimeout WHERE (calendar=1 AND expiry<=$1) OR (calendar=0 AND expiry<=$2) "
+    "ORDER BY wall_expiry",
+
+    /* Move repeating timeouts to their first period after now, see
+       timeout_next_repeat(). Runs before kTimeoutStmtDeleteExpired. */
+    [kTimeoutStmtRepeatExpired] =
+    "UPDATE AlarmTimeout SET expiry=expiry+repeat_secs*"
+    "(((CASE calendar WHEN 1 THEN $1 ELSE $2 END)-expiry)/repeat_secs+1) "
+    "WHERE repeat_secs>0 AND ((calendar=1 AND expiry<=$1) OR (calendar=0 AND expiry<=$2))",
+
+    [kTimeoutStmtDeleteExpired] =
+    "DELETE FROM AlarmTimeout WHERE (calendar=1 AND expiry<=$1) OR (calendar=0 AND expiry<=$2)",
+
+    [kTimeoutStmtSelectAll] =
+    "SELECT app_ref,key,public_bus,wakeup,calendar,expiry,wake_window,repeat_secs FROM AlarmTimeout",
+
+    [kTimeoutStmtInsert] =
+    "INSERT INTO AlarmTimeout (app_ref,key,uri_ref,params,public_bus,wakeup,calendar,expiry,activity_ref,activity_duration_ms,wake_window,repeat_secs) "
+    "VALUES ( $1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12 ) "
+    "ON CONFLICT (app_ref,key,public_bus) DO UPDATE SET "
+    "uri_ref=excluded.uri_ref,params=excluded.params,wakeup=excluded.wakeup,"
+    "calendar=excluded.calendar,expiry=excluded.expiry,"
+    "activity_ref=excluded.activity_ref,activity_duration_ms=excluded.activity_duration_ms,"
+    "wake_window=excluded.wake_window,repeat_secs=excluded.repeat_secs",
+
+    [kTimeoutStmtInsertKeep] =
+    "INSERT INTO AlarmTimeout (app_ref,key,uri_ref,params,public_bus,wakeup,calendar,expiry,activity_ref,activity_duration_ms,wake_window,repeat_secs) "
+    "VALUES ( $1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12 ) "
+    "ON CONFLICT (app_ref,key,public_bus) DO NOTHING",
+
+    [kTimeoutStmtSelectByKey] =
+    "SELECT t1key,app_ref,key,uri_ref,params,public_bus,wakeup,calendar,expiry,activity_ref,activity_duration_ms,"
+    "wake_window,repeat_secs FROM AlarmTimeout WHERE app_ref=$1 AND key=$2 AND public_bus=$3",
+
+    [kTimeoutStmtDeleteByKey] =
+    "DELETE FROM AlarmTimeout WHERE app_ref=$1 AND key=$2 AND public_bus=$3",
+
+    /* served from wakeup_expiry_index alone */
+    [kTimeoutStmtNextWakeupCalendar] =
+    "SELECT expiry,app_ref,key FROM AlarmTimeout "
+    "WHERE wakeup=1 AND calendar=1 AND expiry>$1 ORDER BY expiry LIMIT 1",
+
+    [kTimeoutStmtNextWakeupRelative] =
+    "SELECT expiry,app_ref,key FROM AlarmTimeout "
+    "WHERE wakeup=1 AND calendar=0 AND expiry>$1 ORDER BY expiry LIMIT 1",
+
+    /* One page of timeouts/list in one time domain, walking
+       expiry_domain_index from the (expiry,t1key) position $1,$2 */
+    [kTimeoutStmtListCalendar] =
+    "SELECT t1key,app_ref,key,uri_ref,public_bus,wakeup,expiry FROM AlarmTimeout "
+    "WHERE calendar=1 AND (expiry,t1key)>($1,$2) AND expiry<=$3 "
+    "AND ($4 IS NULL OR app_ref=$4) AND ($5 IS NULL OR wakeup=$5) "
+    "ORDER BY expiry,t1key LIMIT $6",
+
+    [kTimeoutStmtListRelative] =
+    "SELECT t1key,app_ref,key,uri_ref,public_bus,wakeup,expiry FROM AlarmTimeout "
+    "WHERE calendar=0 AND (expiry,t1key)>($1,$2) AND expiry<=$3 "
+    "AND ($4 IS NULL OR app_ref=$4) AND ($5 IS NULL OR wakeup=$5) "
+    "ORDER BY expiry,t1key LIMIT $6",
+
+    [kTimeoutStmtStringAll] = "SELECT id,value FROM TimeoutString",
+    [kTimeoutStmtStringRefs] = "SELECT app_ref,uri_ref,activity_ref FROM AlarmTimeout",
+    [kTimeoutStmtStringInsert] = "INSERT INTO TimeoutString (value) VALUES ( $1 )",
+    [kTimeoutStmtStringDelete] = "DELETE FROM TimeoutString WHERE id=$1",
+
+    /* dictionary references of the row a put replaces or a delete removes */
+    [kTimeoutStmtRefsByKey] =
+    "SELECT uri_ref,activity_ref FROM AlarmTimeout WHERE app_ref=$1 AND key=$2 AND public_bus=$3",
+
+    [kTimeoutStmtBegin] = "BEGIN IMMEDIATE",
+    [kTimeoutStmtCommit] = "COMMIT",
+    [kTimeoutStmtRollback] = "ROLLBACK",
+};
+
+static sqlite3_stmt *timeout_stmts[kTimeoutStmtLast];
+static GRecMutex timeout_stmt_lock;
+
+/*
+   In-memory copy of TimeoutString, so that rows are turned back into
+   strings without a join and without copying them. Guarded by
+   timeout_stmt_lock and kept in step with the database: strings are only
+   added and dropped inside a transaction and the table is reloaded when
+   one is rolled back.
+
+   Each string counts the app_ref, uri_ref and activity_ref columns that
+   refer to it, and is dropped from both when the last one goes.
+   */
+typedef struct
+{
+    gint64 id;
+    guint  refs;
+    char value[];
+} _InternString;
+
+/* references a row holds: app_ref, uri_ref, activity_ref (0 for NULL) */
+#define TIMEOUT_ROW_REFS 3
+
+static GHashTable *intern_by_value = NULL;   /* value -> _InternString, owns it */
+static GHashTable *intern_by_id = NULL;      /* &id -> _InternString */
+
+/* Nesting depth of _sqlite_begin() calls, only the outermost one opens a
+ * transaction. */
+static int timeout_txn_depth = 0;
+
+/**
+* @brief Check whether AlarmTimeout has a column called 'name'.
+*/
+static bool
+_timeout_db_has_column(const char *name)
+{
+    bool found = false;
+    sqlite3_stmt *st;
+
+    if (sqlite3_prepare_v2(timeout_db, "PRAGMA table_info(AlarmTimeout)", -1, &st,
+                           NULL) != SQLITE_OK)
+    {
+        return false;
+    }
+
+    while (!found && sqlite3_step(st) == SQLITE_ROW)
+    {
+        found = g_strcmp0((const char *) sqlite3_column_text(st, 1), name) == 0;
+    }
+
+    sqlite3_finalize(st);
+    return found;
+}
+
+/**
+* @brief Bring the database schema up to date, see kTimeoutMigrations.
+*
+* @retval false if a step failed, the database is left at the last good step
+*/
+static bool
+_timeout_db_migrate(void)
+{
+    int version = 0;
+    sqlite3_stmt *st;
+
+    if (sqlite3_prepare_v2(timeout_db, "PRAGMA user_version", -1, &st,
+                           NULL) != SQLITE_OK)
+    {
+        return false;
+    }
+
+    if (sqlite3_step(st) == SQLITE_ROW)
+    {
+        version = sqlite3_column_int(st, 0);
+    }
+
+    sqlite3_finalize(st);
+
+    /* before the dictionary step, which renames activity_id */
+    if (!_timeout_db_has_column("activity_id") &&
+            !_timeout_db_has_column("activity_ref"))
+    {
+        for (const char **sql = kTimeoutAddActivityColumns; *sql; sql++)
+        {
+            if (!smart_sql_exec(timeout_db, *sql))
+            {
+                SLEEPDLOG_ERROR(MSGID_DB_MIGRATION_FAIL, 1, PMLOGKS("STEP", "activity"),
+                                "could not migrate database");
+                return false;
+            }
+        }
+    }
+
+    for (int step = version; step < G_N_ELEMENTS(kTimeoutMigrations); step++)
+    {
+        bool ok = smart_sql_exec(timeout_db, "BEGIN IMMEDIATE");
+
+        for (const char **sql = kTimeoutMigrations[step]; ok && *sql; sql++)
+        {
+            ok = smart_sql_exec(timeout_db, *sql);
+        }
+
+        if (ok)
+        {
+            gchar *pragma = g_strdup_printf("PRAGMA user_version = %d", step + 1);
+            ok = smart_sql_exec(timeout_db, pragma) &&
+                 smart_sql_exec(timeout_db, "COMMIT");
+            g_free(pragma);
+        }
+
+        if (!ok)
+        {
+            SLEEPDLOG_ERROR(MSGID_DB_MIGRATION_FAIL, 1, PMLOGKFV("STEP", "%d", step + 1),
+                            "could not migrate database");
+            smart_sql_exec(timeout_db, "ROLLBACK");
+            return false;
+        }
+
+        SLEEPDLOG_DEBUG("migrated timeout database to version %d", step + 1);
+    }
+
+    return true;
+}
+
+/**
+* @brief Compile all AlarmTimeout statements.
+*
+* @retval false if any statement failed to prepare
+*/
+static bool
+_timeout_stmts_prepare(void)
+{
+    int i;
+
+    for (i = 0; i < kTimeoutStmtLast; i++)
+    {
+        int rc = sqlite3_prepare_v2(timeout_db, kTimeoutStmtSql[i], -1,
+                                    &timeout_stmts[i], NULL);
+
+        if (rc != SQLITE_OK)
+        {
+            SLEEPDLOG_WARNING(MSGID_SQLITE_PREPARE_FAIL, 2, PMLOGKFV(ERRCODE, "%d", rc),
+                              PMLOGKS(COMMAND, kTimeoutStmtSql[i]), "");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+* @brief Take exclusive use of a prepared statement.
+*
+* @retval NULL if the statements were never prepared (the database failed to
+*         open).
+*/
+static sqlite3_stmt *
+_timeout_stmt_acquire(TimeoutStmt id)
+{
+    if (!timeout_stmts[id])
+    {
+        return NULL;
+    }
+
+    g_rec_mutex_lock(&timeout_stmt_lock);
+    return timeout_stmts[id];
+}
+
+/**
+* @brief Reset a statement and give it back to the cache.
+*/
+static void
+_timeout_stmt_release(sqlite3_stmt *st)
+{
+    sqlite3_reset(st);
+    sqlite3_clear_bindings(st);
+    g_rec_mutex_unlock(&timeout_stmt_lock);
+}
+
+/**
+* @brief Step a statement which returns no rows and release it.
+*/
+static bool
+_sql_step_release(const char *func, sqlite3_stmt *st)
+{
+    int rc;
+
+    rc = sqlite3_step(st);
+
+    _timeout_stmt_release(st);
+
+    if (rc != SQLITE_DONE)
+    {
+        SLEEPDLOG_WARNING(MSGID_SQLITE_STEP_FAIL, 2, PMLOGKFV(ERRCODE, "%d", rc),
+                          PMLOGKS("Function", func), "");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+* @brief (Re)load the intern table from TimeoutString.
+*/
+static bool
+_intern_load(void)
+{
+    int rc;
+    sqlite3_stmt *st = _timeout_stmt_acquire(kTimeoutStmtStringAll);
+
+    if (!st)
+    {
+        return false;
+    }
+
+    if (!intern_by_value)
+    {
+        intern_by_value = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+        intern_by_id = g_hash_table_new(g_int64_hash, g_int64_equal);
+    }
+
+    g_hash_table_remove_all(intern_by_id);
+    g_hash_table_remove_all(intern_by_value);
+
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW)
+    {
+        const char *value = (const char *) sqlite3_column_text(st, 1);
+        size_t len = sqlite3_column_bytes(st, 1);
+        _InternString *s = g_malloc(sizeof(_InternString) + len + 1);
+
+        s->id = sqlite3_column_int64(st, 0);
+        s->refs = 0;
+        memcpy(s->value, value, len + 1);
+
+        g_hash_table_insert(intern_by_value, s->value, s);
+        g_hash_table_insert(intern_by_id, &s->id, s);
+    }
+
+    _timeout_stmt_release(st);
+
+    if (rc != SQLITE_DONE)
+    {
+        goto error;
+    }
+
+    st = _timeout_stmt_acquire(kTimeoutStmtStringRefs);
+
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW)
+    {
+        for (int col = 0; col < TIMEOUT_ROW_REFS; col++)
+        {
+            gint64 id = sqlite3_column_int64(st, col);
+            _InternString *s = g_hash_table_lookup(intern_by_id, &id);
+
+            if (s)
+            {
+                s->refs++;
+            }
+        }
+    }
+
+    _timeout_stmt_release(st);
+
+    if (rc != SQLITE_DONE)
+    {
+        goto error;
+    }
+
+    return true;
+
+error:
+    SLEEPDLOG_WARNING(MSGID_SQLITE_STEP_FAIL, 2, PMLOGKFV(ERRCODE, "%d", rc),
+                      PMLOGKS("Function", __func__), "");
+    return false;
+}
+
+/**
+* @brief Id of an interned string, called with the statement lock held.
+*
+* @retval 0 if 'value' is not interned; since strings are dropped with their
+*         last reference, no timeout uses it then
+*/
+static gint64
+_intern_lookup(const char *value)
+{
+    _InternString *s = g_hash_table_lookup(intern_by_value, value);
+
+    return s ? s->id : 0;
+}
+
+/**
+* @brief Take a reference to 'value' for a row about to be written, adding
+*        it to TimeoutString if it is new. Only call inside a transaction.
+*/
+static bool
+_intern_ref(const char *value, gint64 *id)
+{
+    sqlite3_stmt *st;
+    _InternString *s = g_hash_table_lookup(intern_by_value, value);
+    size_t len;
+
+    if (s)
+    {
+        s->refs++;
+        *id = s->id;
+        return true;
+    }
+
+    st = _timeout_stmt_acquire(kTimeoutStmtStringInsert);
+
+    if (!st)
+    {
+        return false;
+    }
+
+    len = strlen(value);
+    sqlite3_bind_text(st, 1, value, len, SQLITE_STATIC);
+
+    /* hold the lock until last_insert_rowid() is read */
+    g_rec_mutex_lock(&timeout_stmt_lock);
+
+    if (!_sql_step_release(__func__, st))
+    {
+        g_rec_mutex_unlock(&timeout_stmt_lock);
+        return false;
+    }
+
+    s = g_malloc(sizeof(_InternString) + len + 1);
+    s->id = sqlite3_last_insert_rowid(timeout_db);
+    s->refs = 1;
+    memcpy(s->value, value, len + 1);
+
+    g_hash_table_insert(intern_by_value, s->value, s);
+    g_hash_table_insert(intern_by_id, &s->id, s);
+
+    g_rec_mutex_unlock(&timeout_stmt_lock);
+
+    *id = s->id;
+    return true;
+}
+
+/**
+* @brief Drop the references of a row that was replaced, deleted or never
+*        written, and the strings nothing refers to any more. Only call
+*        inside a transaction.
+*/
+static bool
+_intern_release(const gint64 refs[TIMEOUT_ROW_REFS])
+{
+    for (int i = 0; i < TIMEOUT_ROW_REFS; i++)
+    {
+        _InternString *s = g_hash_table_lookup(intern_by_id, &refs[i]);
+
+        if (!s || --s->refs > 0)
+        {
+            continue;
+        }
+
+        sqlite3_stmt *st = _timeout_stmt_acquire(kTimeoutStmtStringDelete);
+        sqlite3_bind_int64(st, 1, s->id);
+
+        if (!_sql_step_release(__func__, st))
+        {
+            return false;
+        }
+
+        g_hash_table_remove(intern_by_id, &s->id);
+        g_hash_table_remove(intern_by_value, s->value);
+    }
+
+    return true;
+}
+
+/**
+* @brief Dictionary references of the timeout stored under a key.
+*
+* @retval false if there is no such timeout
+*/
+static bool
+_timeout_row_refs(gint64 app_ref, const char *key, bool public_bus,
+                  gint64 refs[TIMEOUT_ROW_REFS])
+{
+    bool found = false;
+    sqlite3_stmt *st = _timeout_stmt_acquire(kTimeoutStmtRefsByKey);
+
+    sqlite3_bind_int64(st, 1, app_ref);
+    sqlite3_bind_text(st, 2, key, strlen(key), SQLITE_STATIC);
+    sqlite3_bind_int(st, 3, public_bus);
+
+    if (sqlite3_step(st) == SQLITE_ROW)
+    {
+        refs[0] = app_ref;
+        refs[1] = sqlite3_column_int64(st, 0);
+        refs[2] = sqlite3_column_int64(st, 1);
+        found = true;
+    }
+
+    _timeout_stmt_release(st);
+    return found;
+}
+
+/**
+* @brief String referenced by column 'col' of the current row.
+*
+* @retval NULL if the column is NULL
+*/
+static const char *
+_intern_value(sqlite3_stmt *st, int col)
+{
+    gint64 id;
+    _InternString *s;
+
+    if (sqlite3_column_type(st, col) == SQLITE_NULL)
+    {
+        return NULL;
+    }
+
+    id = sqlite3_column_int64(st, col);
+    s = g_hash_table_lookup(intern_by_id, &id);
+
+    return s ? s->value : "";
+}
+
+static bool
+_sqlite_open(const char *dir)
+{
+    bool retVal;
+
+    gchar *timeout_db_name = g_build_filename(dir, TIMEOUT_DATABASE_NAME, NULL);
+
+    retVal = smart_sql_open(timeout_db_name, &timeout_db);
+
+    if (!retVal)
+    {
+        SLEEPDLOG_ERROR(MSGID_DB_OPEN_ERR, 1, PMLOGKS("DBName", timeout_db_name),
+                        "Failed to open database");
+        g_free(timeout_db_name);
+        return false;
+    }
+
+    g_free(timeout_db_name);
+
+    retVal = smart_sql_exec(timeout_db, kSysTimeoutDatabaseCreateSchema);
+
+    if (!retVal)
+    {
+        SLEEPDLOG_ERROR(MSGID_DB_CREATE_ERR, 0, "could not create database");
+        return false;
+    }
+
+    retVal = smart_sql_exec(timeout_db, kSysTimeoutDatabaseCreateIndex);
+
+    if (!retVal)
+    {
+        SLEEPDLOG_ERROR(MSGID_INDEX_CREATE_FAIL, 0, "could not create index");
+        return false;
+    }
+
+    smart_sql_exec(timeout_db, kSysTimeoutDatabaseDropIndex);
+
+    if (!_timeout_db_migrate())
+    {
+        return false;
+    }
+
+    smart_sql_exec(timeout_db, kTimeoutStringsCollect);
+
+    if (!_timeout_stmts_prepare())
+    {
+        SLEEPDLOG_ERROR(MSGID_DB_CREATE_ERR, 0, "could not prepare statements");
+        return false;
+    }
+
+    return _intern_load();
+}
+
+static void
+_sqlite_flush(void)
+{
+    if (!timeout_db)
+    {
+        return;
+    }
+
+    g_rec_mutex_lock(&timeout_stmt_lock);
+
+    /* fold the write-ahead log back so the next open has nothing to replay */
+    sqlite3_wal_checkpoint_v2(timeout_db, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+                              NULL, NULL);
+    smart_sql_mark_clean(timeout_db);
+
+    g_rec_mutex_unlock(&timeout_stmt_lock);
+}
+
+/**
+* @brief Open a transaction on the timeout database, or join the one already
+*        open.
+*
+* Must be paired with _sqlite_commit() or _sqlite_rollback(). The
+* statement lock stays held until then.
+*/
+static bool
+_sqlite_begin(void)
+{
+    sqlite3_stmt *st = _timeout_stmt_acquire(kTimeoutStmtBegin);
+
+    if (!st)
+    {
+        return false;
+    }
+
+    if (timeout_txn_depth++ > 0)
+    {
+        /* keep the lock taken by acquire for the whole transaction */
+        return true;
+    }
+
+    /* every write goes through here; one after _sqlite_flush() voids the
+     * clean marker it left */
+    smart_sql_mark_dirty(timeout_db);
+
+    int rc = sqlite3_step(st);
+
+    sqlite3_reset(st);
+
+    if (rc != SQLITE_DONE)
+    {
+        SLEEPDLOG_WARNING(MSGID_SQLITE_STEP_FAIL, 2, PMLOGKFV(ERRCODE, "%d", rc),
+                          PMLOGKS(COMMAND, "BEGIN"), "");
+        timeout_txn_depth--;
+        g_rec_mutex_unlock(&timeout_stmt_lock);
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+_sqlite_end(TimeoutStmt id)
+{
+    int rc = SQLITE_DONE;
+
+    if (--timeout_txn_depth == 0)
+    {
+        sqlite3_stmt *st = timeout_stmts[id];
+
+        rc = sqlite3_step(st);
+        sqlite3_reset(st);
+
+        if (rc != SQLITE_DONE)
+        {
+            SLEEPDLOG_WARNING(MSGID_SQLITE_STEP_FAIL, 2, PMLOGKFV(ERRCODE, "%d", rc),
+                              PMLOGKS(COMMAND, kTimeoutStmtSql[id]), "");
+
+            /* a failed COMMIT may leave the transaction open */
+            if (id == kTimeoutStmtCommit && !sqlite3_get_autocommit(timeout_db))
+            {
+                sqlite3_step(timeout_stmts[kTimeoutStmtRollback]);
+                sqlite3_reset(timeout_stmts[kTimeoutStmtRollback]);
+            }
+        }
+
+        /* strings interned by the transaction may be gone again */
+        if (id == kTimeoutStmtRollback || rc != SQLITE_DONE)
+        {
+            _intern_load();
+        }
+    }
+
+    g_rec_mutex_unlock(&timeout_stmt_lock);
+    return rc == SQLITE_DONE;
+}
+
+static bool
+_sqlite_commit(void)
+{
+    return _sqlite_end(kTimeoutStmtCommit);
+}
+
+static bool
+_sqlite_rollback(void)
+{
+    return _sqlite_end(kTimeoutStmtRollback);
+}
+
+static bool
+_sqlite_put(const _AlarmTimeout *timeout, bool keep_existing, bool *kept)
+{
+    sqlite3_stmt *st;
+    gint64 refs[TIMEOUT_ROW_REFS] = { 0 };
+    gint64 old_refs[TIMEOUT_ROW_REFS];
+    bool replaces;
+
+    if (!_sqlite_begin())
+    {
+        return false;
+    }
+
+    /* new strings are added in the same transaction as the row */
+    if (!_intern_ref(timeout->app_id ? : "", &refs[0]) ||
+            !_intern_ref(timeout->uri, &refs[1]) ||
+            (timeout->activity_id && !_intern_ref(timeout->activity_id, &refs[2])))
+    {
+        goto error;
+    }
+
+    replaces = _timeout_row_refs(refs[0], timeout->key, timeout->public_bus,
+                                 old_refs);
+
+    st = _timeout_stmt_acquire(keep_existing ? kTimeoutStmtInsertKeep :
+                               kTimeoutStmtInsert);
+
+    sqlite3_bind_int64(st,  1, refs[0]);
+    sqlite3_bind_text(st,  2, timeout->key, strlen(timeout->key), SQLITE_STATIC);
+    sqlite3_bind_int64(st,  3, refs[1]);
+    sqlite3_bind_text(st,  4, timeout->params, strlen(timeout->params),
+                      SQLITE_STATIC);
+    sqlite3_bind_int(st,  5, timeout->public_bus);
+    sqlite3_bind_int(st,  6, timeout->wakeup);
+    sqlite3_bind_int(st,  7, timeout->calendar);
+    sqlite3_bind_int64(st,  8, timeout->expiry);
+
+    if (timeout->activity_id)
+    {
+        sqlite3_bind_int64(st,  9, refs[2]);
+    }
+
+    sqlite3_bind_int(st, 10, timeout->activity_duration_ms);
+    sqlite3_bind_int64(st, 11, timeout->window);
+    sqlite3_bind_int64(st, 12, timeout->repeat);
+
+    if (!_sql_step_release(__func__, st))
+    {
+        goto error;
+    }
+
+    /* still inside the transaction, so changes() is ours */
+    *kept = (sqlite3_changes(timeout_db) == 0);
+
+    /* whichever row is gone now gives up its strings */
+    if ((*kept && !_intern_release(refs)) ||
+            (!*kept && replaces && !_intern_release(old_refs)))
+    {
+        goto error;
+    }
+
+    return _sqlite_commit();
+
+error:
+    SLEEPDLOG_WARNING(MSGID_ALARM_TIMEOUT_INSERT, 0,
+                      "Insert into AlarmTimeout failed");
+    _sqlite_rollback();
+    return false;
+}
+
+static bool
+_sqlite_get(_AlarmTimeoutNonConst *timeout, const char *app_id,
+            const char *key, bool public_bus)
+{
+    bool ret = false;
+    int rc;
+    gint64 app_ref;
+    sqlite3_stmt *st = _timeout_stmt_acquire(kTimeoutStmtSelectByKey);
+
+    if (!st)
+    {
+        return false;
+    }
+
+    /* an application no timeout refers to has no id */
+    if ((app_ref = _intern_lookup(app_id)) == 0)
+    {
+        _timeout_stmt_release(st);
+        return false;
+    }
+
+    sqlite3_bind_int64(st, 1, app_ref);
+    sqlite3_bind_text(st, 2, key, strlen(key), SQLITE_STATIC);
+    sqlite3_bind_int(st, 3, public_bus);
+
+    rc = sqlite3_step(st);
+
+    if (rc == SQLITE_ROW)
+    {
+        timeout->table_id               = g_strdup((const char *) sqlite3_column_text(st, 0));
+        timeout->app_id                 = g_strdup(_intern_value(st, 1));
+        timeout->key                    = g_strdup((const char *) sqlite3_column_text(st, 2));
+        timeout->uri                    = g_strdup(_intern_value(st, 3));
+        timeout->params                 = g_strdup((const char *) sqlite3_column_text(st, 4));
+        timeout->public_bus             = sqlite3_column_int(st, 5);
+        timeout->wakeup                 = sqlite3_column_int(st, 6);
+        timeout->calendar               = sqlite3_column_int(st, 7);
+        timeout->expiry                 = sqlite3_column_int64(st, 8);
+
+        // The two "activity" fields could be null if this is an
+        // old record where the new columns were inserted.
+        timeout->activity_id            = g_strdup(_intern_value(st, 9) ? : DEFAULT_ACTIVITY_ID);
+        timeout->activity_duration_ms   = sqlite3_column_type(st, 10) != SQLITE_NULL ?
+                                          sqlite3_column_int(st, 10) : TIMEOUT_KEEP_ALIVE_MS;
+        timeout->window                 = sqlite3_column_int64(st, 11);
+        timeout->repeat                 = sqlite3_column_int64(st, 12);
+
+        ret = true;
+
+        if (sqlite3_step(st) == SQLITE_ROW)
+        {
+            SLEEPDLOG_DEBUG("multiple rows for (%s, %s, %s)",
+                            app_id, key, public_bus ? "public" : "private");
+        }
+    }
+    else if (rc != SQLITE_DONE)
+    {
+        SLEEPDLOG_WARNING(MSGID_SELECT_ALL_FROM_TIMEOUT, 2,
+                          PMLOGKS(ERRTEXT, sqlite3_errmsg(timeout_db)),
+                          PMLOGKFV(ERRCODE, "%d", rc), "");
+    }
+
+    _timeout_stmt_release(st);
+
+    return ret;
+}
+
+static bool
+_sqlite_delete(const char *app_id, const char *key, bool public_bus)
+{
+    gint64 refs[TIMEOUT_ROW_REFS];
+    sqlite3_stmt *st;
+
+    if (!_sqlite_begin())
+    {
+        SLEEPDLOG_DEBUG("Could not remove AlarmTimeout, no transaction");
+        return false;
+    }
+
+    /* an unknown application or key leaves nothing to delete */
+    gint64 app_ref = _intern_lookup(app_id);
+
+    if (app_ref == 0 || !_timeout_row_refs(app_ref, key, public_bus, refs))
+    {
+        return _sqlite_commit();
+    }
+
+    st = _timeout_stmt_acquire(kTimeoutStmtDeleteByKey);
+    sqlite3_bind_int64(st, 1, app_ref);
+    sqlite3_bind_text(st, 2, key, strlen(key), SQLITE_STATIC);
+    sqlite3_bind_int(st, 3, public_bus);
+
+    if (!_sql_step_release(__func__, st) || !_intern_release(refs))
+    {
+        _sqlite_rollback();
+        return false;
+    }
+
+    return _sqlite_commit();
+}
+
+static bool
+_sqlite_scan_due(time_t now, time_t now_relative, TimeoutStoreFunc func,
+                 void *data)
+{
+    int rc;
+    _AlarmTimeout timeout;
+    unsigned int expired = 0;
+    unsigned int repeated = 0;
+    /* dictionary references of the rows deleted below */
+    GArray *gone;
+
+    if (!_sqlite_begin())
+    {
+        return false;
+    }
+
+    gone = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+    sqlite3_stmt *st = _timeout_stmt_acquire(kTimeoutStmtSelectExpired);
+
+    /* Find all expired timeouts */
+    sqlite3_bind_int64(st, 1, now);
+    sqlite3_bind_int64(st, 2, now_relative);
+
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW)
+    {
+        timeout.table_id = NULL;
+        timeout.app_id = _intern_value(st, 0);
+        timeout.key = (const char *) sqlite3_column_text(st, 1);
+        timeout.uri = _intern_value(st, 2);
+        timeout.params = (const char *) sqlite3_column_text(st, 3);
+        timeout.public_bus = sqlite3_column_int(st, 4);
+
+        /*
+          If we have an upgraded db where the activity_id and activity_duration_ms columns were
+          added and there were existing rows then these two fields will return NULL.
+        */
+        if (sqlite3_column_type(st, 5) == SQLITE_NULL ||
+                sqlite3_column_type(st, 6) == SQLITE_NULL)
+        {
+            SLEEPDLOG_DEBUG("null activity_id or activity_duration_ms fields for \"%s\":\"%s\"",
+                            timeout.app_id, timeout.key);
+        }
+
+        timeout.activity_id = _intern_value(st,
+                                            5); // _timeout_keep_alive can handle a null activity_id
+        timeout.activity_duration_ms = sqlite3_column_int(st,
+                                       6); // _timeout_keep_alive will fill-in the default duration
+        timeout.wakeup = sqlite3_column_int(st, 7);
+        timeout.calendar = sqlite3_column_int(st, 8);
+        timeout.expiry = sqlite3_column_int64(st, 9);
+        timeout.window = sqlite3_column_int64(st, 10);
+        timeout.repeat = sqlite3_column_int64(st, 11);
+
+        func(&timeout, data);
+
+        if (timeout.repeat > 0)
+        {
+            repeated++;
+        }
+        else
+        {
+            gint64 refs[TIMEOUT_ROW_REFS] =
+            {
+                sqlite3_column_int64(st, 0), sqlite3_column_int64(st, 2),
+                sqlite3_column_int64(st, 5)
+            };
+
+            g_array_append_vals(gone, refs, TIMEOUT_ROW_REFS);
+        }
+
+        expired++;
+    }
+
+    if (rc != SQLITE_DONE)
+    {
+        SLEEPDLOG_WARNING(MSGID_SELECT_EXPIRED_TIMEOUT, 2,
+                          PMLOGKS(ERRTEXT, sqlite3_errmsg(timeout_db)),
+                          PMLOGKFV(ERRCODE, "%d", rc), "");
+    }
+
+    _timeout_stmt_release(st);
+
+    /* Rows past the failing step never reached func; advancing or deleting
+     * the whole due range would drop them. Leave everything due instead, at
+     * the cost of firing the rows seen so far again on the next pass. */
+    if (rc != SQLITE_DONE)
+    {
+        g_array_free(gone, TRUE);
+        _sqlite_rollback();
+        return false;
+    }
+
+    /* Advance repeating timeouts, then delete the rest of what we just
+     * fired, a single statement each. */
+    if (repeated)
+    {
+        st = _timeout_stmt_acquire(kTimeoutStmtRepeatExpired);
+        sqlite3_bind_int64(st, 1, now);
+        sqlite3_bind_int64(st, 2, now_relative);
+        _sql_step_release(__func__, st);
+    }
+
+    if (expired > repeated)
+    {
+        st = _timeout_stmt_acquire(kTimeoutStmtDeleteExpired);
+        sqlite3_bind_int64(st, 1, now);
+        sqlite3_bind_int64(st, 2, now_relative);
+
+        /* Strings of the deleted rows go in the same transaction. The
+         * timeouts have fired already, so this is committed even if that
+         * fails; strings left behind are collected on the next open. */
+        bool deleted = _sql_step_release(__func__, st);
+
+        for (guint i = 0; deleted && i < gone->len; i += TIMEOUT_ROW_REFS)
+        {
+            deleted = _intern_release(&g_array_index(gone, gint64, i));
+        }
+    }
+
+    g_array_free(gone, TRUE);
+
+    return _sqlite_commit();
+}
+
+static bool
+_sqlite_scan_all(TimeoutStoreFunc func, void *data)
+{
+    int rc;
+    _AlarmTimeout timeout = { 0 };
+    sqlite3_stmt *st = _timeout_stmt_acquire(kTimeoutStmtSelectAll);
+
+    if (!st)
+    {
+        return false;
+    }
+
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW)
+    {
+        timeout.app_id = _intern_value(st, 0);
+        timeout.key = (const char *) sqlite3_column_text(st, 1);
+        timeout.public_bus = sqlite3_column_int(st, 2);
+        timeout.wakeup = sqlite3_column_int(st, 3);
+        timeout.calendar = sqlite3_column_int(st, 4);
+        timeout.expiry = sqlite3_column_int64(st, 5);
+        timeout.window = sqlite3_column_int64(st, 6);
+        timeout.repeat = sqlite3_column_int64(st, 7);
+
+        func(&timeout, data);
+    }
+
+    _timeout_stmt_release(st);
+
+    if (rc != SQLITE_DONE)
+    {
+        SLEEPDLOG_WARNING(MSGID_SELECT_ALL_FROM_TIMEOUT, 2,
+                          PMLOGKS(ERRTEXT, sqlite3_errmsg(timeout_db)),
+                          PMLOGKFV(ERRCODE, "%d", rc), "");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+_sqlite_next_wakeup_in(TimeoutStmt id, time_t after, time_t offset,
+                       time_t *expiry)
+{
+    bool found = false;
+    sqlite3_stmt *st = _timeout_stmt_acquire(id);
+
+    if (!st)
+    {
+        return false;
+    }
+
+    sqlite3_bind_int64(st, 1, after - offset);
+
+    if (sqlite3_step(st) == SQLITE_ROW)
+    {
+        *expiry = sqlite3_column_int64(st, 0) + offset;
+        found = true;
+    }
+
+    _timeout_stmt_release(st);
+    return found;
+}
+
+static bool
+_sqlite_next_wakeup(time_t after, time_t *expiry)
+{
+    time_t cal_expiry, rel_expiry;
+    bool cal = _sqlite_next_wakeup_in(kTimeoutStmtNextWakeupCalendar, after, 0,
+                                      &cal_expiry);
+    bool rel = _sqlite_next_wakeup_in(kTimeoutStmtNextWakeupRelative, after,
+                                      reference_drift(), &rel_expiry);
+
+    if (cal && (!rel || cal_expiry <= rel_expiry))
+    {
+        *expiry = cal_expiry;
+    }
+    else if (rel)
+    {
+        *expiry = rel_expiry;
+    }
+
+    return cal || rel;
+}
+
+/**
+* @brief Bind one page of a list statement.
+*
+* Positions are wall times; relative rows are matched by moving the bounds
+* into relative time.
+*/
+static void
+_sqlite_list_bind(sqlite3_stmt *st, time_t offset, gint64 app_ref,
+                  const TimeoutStoreListQuery *query)
+{
+    sqlite3_bind_int64(st, 1, query->after - offset);
+    sqlite3_bind_int64(st, 2, query->after_id);
+    sqlite3_bind_int64(st, 3, query->until - offset);
+
+    if (query->app_id)
+    {
+        sqlite3_bind_int64(st, 4, app_ref);
+    }
+
+    if (query->wakeup >= 0)
+    {
+        sqlite3_bind_int(st, 5, query->wakeup);
+    }
+
+    /* at most 'limit' rows, plus one to tell whether there is a next page */
+    sqlite3_bind_int(st, 6, query->limit + 1);
+}
+
+/**
+* @brief One page of timeouts: calendar and relative timeouts are read with
+*        one indexed range scan each and merged.
+*/
+static bool
+_sqlite_list(const TimeoutStoreListQuery *query, TimeoutStoreListFunc func,
+             void *data, bool *more)
+{
+    sqlite3_stmt *cal, *rel;
+    int cal_rc, rel_rc;
+    int count = 0;
+    time_t drift;
+    gint64 app_ref;
+
+    *more = false;
+
+    cal = _timeout_stmt_acquire(kTimeoutStmtListCalendar);
+
+    if (!cal)
+    {
+        return false;
+    }
+
+    rel = _timeout_stmt_acquire(kTimeoutStmtListRelative);
+
+    drift = reference_drift();
+
+    /* an unknown application binds id 0, which matches nothing */
+    app_ref = query->app_id ? _intern_lookup(query->app_id) : 0;
+
+    _sqlite_list_bind(cal, 0, app_ref, query);
+    _sqlite_list_bind(rel, drift, app_ref, query);
+
+    cal_rc = sqlite3_step(cal);
+    rel_rc = sqlite3_step(rel);
+
+    while (cal_rc == SQLITE_ROW || rel_rc == SQLITE_ROW)
+    {
+        bool take_cal;
+
+        if (cal_rc != SQLITE_ROW)
+        {
+            take_cal = false;
+        }
+        else if (rel_rc != SQLITE_ROW)
+        {
+            take_cal = true;
+        }
+        else
+        {
+            time_t cal_expiry = sqlite3_column_int64(cal, 6);
+            time_t rel_expiry = sqlite3_column_int64(rel, 6) + drift;
+
+            take_cal = cal_expiry < rel_expiry ||
+                       (cal_expiry == rel_expiry &&
+                        sqlite3_column_int64(cal, 0) < sqlite3_column_int64(rel, 0));
+        }
+
+        if (count == query->limit)
+        {
+            *more = true;
+            break;
+        }
+
+        sqlite3_stmt *st = take_cal ? cal : rel;
+        time_t offset = take_cal ? 0 : drift;
+        _AlarmTimeout timeout = { 0 };
+
+        timeout.app_id = _intern_value(st, 1) ? : "";
+        timeout.key = (const char *) sqlite3_column_text(st, 2) ? : "";
+        timeout.uri = _intern_value(st, 3) ? : "";
+        timeout.public_bus = sqlite3_column_int(st, 4);
+        timeout.wakeup = sqlite3_column_int(st, 5);
+        timeout.calendar = take_cal;
+        timeout.expiry = sqlite3_column_int64(st, 6);
+
+        func(&timeout, timeout.expiry + offset, sqlite3_column_int64(st, 0), data);
+        count++;
+
+        if (take_cal)
+        {
+            cal_rc = sqlite3_step(cal);
+        }
+        else
+        {
+            rel_rc = sqlite3_step(rel);
+        }
+    }
+
+    _timeout_stmt_release(rel);
+    _timeout_stmt_release(cal);
+
+    return true;
+}
+
+static void
+_sqlite_diagnostics(GString *payload)
+{
+    SmartSqlProfile profile;
+    SmartSqlCheckStats checks;
+
+    g_rec_mutex_lock(&timeout_stmt_lock);
+
+    if (smart_sql_get_profile(timeout_db, &profile))
+    {
+        g_string_append_printf(payload,
+                               ",\"database\":{\"journalMode\":\"%s\",\"synchronous\":%d,"
+                               "\"walAutocheckpoint\":%d,\"mmapSize\":%lld,\"strings\":%u}",
+                               profile.journal_mode, profile.synchronous,
+                               profile.wal_autocheckpoint, profile.mmap_size,
+                               intern_by_value ? g_hash_table_size(intern_by_value) : 0);
+    }
+
+    g_rec_mutex_unlock(&timeout_stmt_lock);
+
+    smart_sql_get_check_stats(&checks);
+    g_string_append_printf(payload,
+                           ",\"integrityCheck\":{\"cleanShutdown\":%s,\"quickMs\":%d,"
+                           "\"fullMs\":%d,\"deferredMs\":%d,\"deferredPending\":%s}",
+                           checks.clean_shutdown ? "true" : "false",
+                           checks.quick_ms, checks.full_ms, checks.deferred_ms,
+                           checks.deferred_pending ? "true" : "false");
+}
+
+const TimeoutStore timeout_store_sqlite =
+{
+    .name = "sqlite",
+    .open = _sqlite_open,
+    .flush = _sqlite_flush,
+    .begin = _sqlite_begin,
+    .commit = _sqlite_commit,
+    .rollback = _sqlite_rollback,
+    .put = _sqlite_put,
+    .get = _sqlite_get,
+    .delete = _sqlite_delete,
+    .scan_due = _sqlite_scan_due,
+    .scan_all = _sqlite_scan_all,
+    .next_wakeup = _sqlite_next_wakeup,
+    .list = _sqlite_list,
+    .diagnostics = _sqlite_diagnostics,
+};
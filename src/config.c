@@ -61,6 +61,17 @@ SleepConfiguration gSleepConfig =
 
     .preference_dir = WEBOS_INSTALL_LOCALSTATEDIR "/preferences/com.palm.sleep",
 
+    .alarm_backend = "nyx",
+    .alarm_storage = "sqlite",
+    .alarm_fire_concurrency = 8,
+    .alarm_fire_timeout_ms = 10000,
+    .alarm_max_timeouts_per_app = 1000,
+
+    .db_journal_mode = "delete",
+    .db_synchronous = "off",
+    .db_wal_autocheckpoint = 1000,
+    .db_mmap_size = 0,
+
     .fasthalt = false
 };
 
@@ -89,6 +100,19 @@ do {                                                            \
     else { g_error_free(gerror); }                              \
 } while (0)
 
+/* the string is kept for the lifetime of the process */
+#define CONFIG_GET_STRING(keyfile,cat,name,var)                 \
+do {                                                            \
+    char *strVal;                                               \
+    GError *gerror = NULL;                                      \
+    strVal = g_key_file_get_string(keyfile,cat,name,&gerror);   \
+    if (!gerror) {                                              \
+        var = strVal;                                           \
+        SLEEPDLOG_DEBUG(#var " = %s", strVal);                          \
+    }                                                           \
+    else { g_error_free(gerror); }                              \
+} while (0)
+
 static int
 config_init(void)
 {
@@ -146,6 +170,28 @@ config_init(void)
 
         CONFIG_GET_BOOL(config_file, "suspend", "fasthalt",
                         gSleepConfig.fasthalt);
+
+        /// [alarms]
+        CONFIG_GET_STRING(config_file, "alarms", "backend",
+                          gSleepConfig.alarm_backend);
+        CONFIG_GET_STRING(config_file, "alarms", "storage",
+                          gSleepConfig.alarm_storage);
+        CONFIG_GET_INT(config_file, "alarms", "fire_concurrency",
+                       gSleepConfig.alarm_fire_concurrency);
+        CONFIG_GET_INT(config_file, "alarms", "fire_reply_timeout_ms",
+                       gSleepConfig.alarm_fire_timeout_ms);
+        CONFIG_GET_INT(config_file, "alarms", "max_timeouts_per_app",
+                       gSleepConfig.alarm_max_timeouts_per_app);
+
+        /// [database]
+        CONFIG_GET_STRING(config_file, "database", "journal_mode",
+                          gSleepConfig.db_journal_mode);
+        CONFIG_GET_STRING(config_file, "database", "synchronous",
+                          gSleepConfig.db_synchronous);
+        CONFIG_GET_INT(config_file, "database", "wal_autocheckpoint",
+                       gSleepConfig.db_wal_autocheckpoint);
+        CONFIG_GET_INT(config_file, "database", "mmap_size",
+                       gSleepConfig.db_mmap_size);
     }
     else
     {
@@ -75,6 +75,7 @@
 #include "init.h"
 #include "logging.h"
 #include "main.h"
+#include "timeout_alarm.h"
 
 
 static GMainLoop *mainloop = NULL;
@@ -297,6 +298,9 @@ main(int argc, char **argv)
 
     g_main_loop_run(mainloop);
 
+    /* we get here through term_handler */
+    timeout_alarm_shutdown();
+
 error:
     g_main_loop_unref(mainloop);
     return 0;
@@ -35,6 +35,8 @@
 #include "machine.h"
 #include "init.h"
 #include "json_utils.h"
+#include "timeout_alarm.h"
+#include "alarm_backend.h"
 
 #define LOG_DOMAIN "SHUTDOWN: "
 
@@ -801,7 +803,9 @@ state_shutdown_action(ShutdownEvent *event, ShutdownState *next)
         shutdown_message = NULL;
     }
 
-    nyx_system_set_alarm(GetNyxSystemDevice(), 0, NULL, NULL);
+    alarm_backend_set(0, false);
+
+    timeout_alarm_shutdown();
 
     return false;
 }